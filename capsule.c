@@ -1,26 +1,98 @@
 #include <assert.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libevdev/libevdev-uinput.h>
+#include <libgen.h>
+#include <limits.h>
 #include <linux/input.h>
-#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ERROR(fmt, ...) fprintf(stderr, "Error: " fmt "\n", ##__VA_ARGS__);
 #define WARNING(fmt, ...) fprintf(stderr, "Warning: " fmt "\n", ##__VA_ARGS__);
+// Build with -DDEBUG_LOGGING=0 (make release) to compile --debug out of the event path entirely
+#ifndef DEBUG_LOGGING
+#define DEBUG_LOGGING 1
+#endif
+
 #define DEBUG(fmt, ...) \
-  if (log_level >= LOG_LEVEL_DEBUG) \
+  if (DEBUG_LOGGING && log_level >= LOG_LEVEL_DEBUG) \
   printf("Debug [%s]: " fmt " [%s:%d]\n", __func__, ##__VA_ARGS__, __FILE__, __LINE__)
+#define LOG_EVENT(keyboard, direction, time_ns, type, code, value) \
+  if (DEBUG_LOGGING && log_level >= LOG_LEVEL_DEBUG) \
+  log_event(keyboard, direction, time_ns, type, code, value)
 
 #define ARRAY_SIZE(some_array) (sizeof(some_array) / sizeof((some_array)[0]))
+#define CONTAINER_OF(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+#define BITSET_NUM_WORDS(num_bits) (((num_bits) + 63) / 64)
 
 #define INPUT_DEVICE_PATH "/dev/input/by-path"
+#define UDEV_DATA_PATH "/run/udev/data"  // udev writes c<major>:<minor> here once it's done
+#define DEFAULT_CONFIG_PATH "/etc/capsule.conf"  // Used if present; otherwise action_table is used
+#define STATS_FILE_PATH "/run/capsule/stats"  // struct stats_page, mapped for monitoring
+
+#define OUTPUT_BUFFER_MAX_NUM_EVENTS 64  // Events queued for uinput before a forced flush
+#define EPOLL_MAX_NUM_EVENTS 16  // Ready fds handled per epoll_wait() call
+#define BULK_READ_MAX_NUM_EVENTS 64  // Events per read() with --bulk-read
+#define MAX_NUM_LAYERS 32  // Active layers are kept in a uint32_t bitmask
+#define MAX_LAYER_NAME_LENGTH 31
+#define MAX_NUM_COMBOS 256
+#define MAX_NUM_COMBO_KEYS 64  // Keys used in combos, all of them together; a uint64_t bitmask
+#define MAX_COMBO_LENGTH 4  // Keys in one combo
+#define MAX_NUM_FIRED_COMBOS 4  // Combos held down at the same time, per keyboard
+#define DEFAULT_COMBO_TERM_MS 30  // Keys of a combo must all be pressed within this
+#define MAX_MACRO_DELAY_MS 10000
+#define MAX_KEY_REPEAT_DELAY_MS 10000
+#define MAX_KEY_REPEAT_RATE 1000  // Repeats per second
+#define MOUSE_TICK_MS 8  // Mouse keys move the pointer at this interval
+#define MOUSE_WHEEL_SPEED 10  // Wheel notches per second for mouse keys
+#define DEFAULT_MOUSE_START_SPEED 200  // Pixels per second, when a mouse key is pressed
+#define DEFAULT_MOUSE_MAX_SPEED 1600  // ... and after it's been held for:
+#define DEFAULT_MOUSE_ACCELERATION_MS 1000
+#define DEFAULT_MOUSE_CURVE_EXPONENT 2  // 1 for linear acceleration, 2 for quadratic, ...
+#define MAX_MOUSE_CURVE_EXPONENT 8
+#define MAX_MOUSE_SPEED 100000
+#define MAX_MOUSE_ACCELERATION_MS 60000
+#define MAX_NUM_DEBOUNCE_RULES 16  // --debounce DEVICE=MS switches
+#define MAX_DEBOUNCE_MS 1000
+#define DEFAULT_REALTIME_PRIORITY 50  // SCHED_FIFO priority used by --realtime
+#define PREFAULT_STACK_SIZE (256 * 1024)  // Stack touched before locking memory in --realtime
+#define GRAB_TIMEOUT_MS 1000  // Grab keyboards by then, even if udev hasn't seen our uinput device
+#define EVENT_LOG_NUM_RECORDS 4096  // Events logged with --debug between drains; a power of two
+#define STATS_MAX_NUM_KEYBOARDS 64  // Keyboards with higher indices aren't in the stats file
+#define STATS_MAX_NUM_ACTIONS 1024
+
+// Traces start with this magic, followed by struct trace_record entries in host byte order
+#define TRACE_FILE_MAGIC "CAPSULE TRACE 1\n"
+
+// The stats file is a struct stats_page starting with this magic, in host byte order
+#define STATS_FILE_MAGIC "CAPSULE STATS 1\n"
+
+// Latency histograms have 2^LATENCY_SUB_BUCKET_BITS linear sub-buckets per power of two of
+// nanoseconds, i.e. percentiles are accurate to within 25%
+#define LATENCY_SUB_BUCKET_BITS 2
+#define LATENCY_NUM_BUCKETS (64 << LATENCY_SUB_BUCKET_BITS)
 
 static enum {
   LOG_LEVEL_ERROR,
@@ -28,16 +100,81 @@ static enum {
   LOG_LEVEL_DEBUG,
 } log_level = LOG_LEVEL_WARNING;
 
-static const struct {
-  const uint16_t code;  // If Caps Lock is pressed, try match with this key code
-  const struct {
-    uint16_t code;
+// Layers are stacked in index order, with the base layer at the bottom, and each active layer is
+// searched for an action from the top down
+enum {
+  BASE_LAYER,  // Always active; keys without an action anywhere are forwarded as they are
+  CAPS_LOCK_LAYER,  // Active while Caps Lock is held
+};
+
+enum action_kind {
+  ACTION_KIND_KEY,  // Send the output key combo
+  ACTION_KIND_MOMENTARY_LAYER,  // Activate output.layer while the key is held
+  ACTION_KIND_TOGGLE_LAYER,  // Activate or deactivate output.layer
+  ACTION_KIND_ONE_SHOT_LAYER,  // Activate output.layer for the next key press
+  ACTION_KIND_MACRO,  // Play output.macro when pressed
+  ACTION_KIND_MOUSE_MOTION,  // Move the pointer, or scroll, as output.code while the key is held
+  ACTION_KIND_MOUSE_BUTTON,  // Send the output.code button on the mouse device
+};
+
+enum mouse_motion {
+  MOUSE_MOTION_UP,
+  MOUSE_MOTION_DOWN,
+  MOUSE_MOTION_LEFT,
+  MOUSE_MOTION_RIGHT,
+  MOUSE_MOTION_WHEEL_UP,
+  MOUSE_MOTION_WHEEL_DOWN,
+  MOUSE_MOTION_WHEEL_LEFT,
+  MOUSE_MOTION_WHEEL_RIGHT,
+  MOUSE_NUM_MOTIONS,
+};
+
+// Names of the mouse outputs in the config file, and what they send. Motions come first, in enum
+// order, so that they can be looked up by it.
+static const struct mouse_output {
+  const char* name;
+  enum action_kind kind;
+  uint16_t code;  // enum mouse_motion, or button
+  uint16_t rel_code;  // For motions
+  int direction;
+} mouse_outputs[] = {
+    {"MOUSE_UP", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_UP, REL_Y, -1},
+    {"MOUSE_DOWN", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_DOWN, REL_Y, 1},
+    {"MOUSE_LEFT", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_LEFT, REL_X, -1},
+    {"MOUSE_RIGHT", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_RIGHT, REL_X, 1},
+    {"WHEEL_UP", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_WHEEL_UP, REL_WHEEL, 1},
+    {"WHEEL_DOWN", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_WHEEL_DOWN, REL_WHEEL, -1},
+    {"WHEEL_LEFT", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_WHEEL_LEFT, REL_HWHEEL, -1},
+    {"WHEEL_RIGHT", ACTION_KIND_MOUSE_MOTION, MOUSE_MOTION_WHEEL_RIGHT, REL_HWHEEL, 1},
+    {"BTN_LEFT", ACTION_KIND_MOUSE_BUTTON, BTN_LEFT, 0, 0},
+    {"BTN_RIGHT", ACTION_KIND_MOUSE_BUTTON, BTN_RIGHT, 0, 0},
+    {"BTN_MIDDLE", ACTION_KIND_MOUSE_BUTTON, BTN_MIDDLE, 0, 0},
+};
+
+// Repeats generated by capsule, instead of passing on those of the kernel
+struct key_repeat {
+  uint16_t delay_ms;  // From the press to the first repeat
+  uint16_t rate;  // Repeats per second; 0 to leave repeating to the kernel
+};
+
+struct action {
+  uint16_t code;  // If the action's layer is active, try match with this key code
+  uint8_t layer;
+  enum action_kind kind;
+  struct key_repeat repeat;  // For ACTION_KIND_KEY
+  struct {
+    uint16_t code;  // Key, or for the mouse kinds enum mouse_motion or button
     bool shift;
     bool left_alt;
     bool right_alt;
     bool left_ctrl;
+    uint8_t layer;  // For the layer kinds
+    uint16_t macro;  // For macros; index into keymap->macros
   } output;  // ... and if it matches, send this key combo
-} action_table[] = {
+};
+
+// Default mapping for CAPS_LOCK_LAYER, for when there's no config file
+static const struct action action_table[] = {
     // Use Vim bindings for HJKL
     {.code = KEY_H, .output = {.code = KEY_LEFT}},
     {.code = KEY_J, .output = {.code = KEY_DOWN}},
@@ -70,416 +207,3872 @@ static const struct {
     {.code = KEY_SLASH, .output = {.code = KEY_7, .shift = true}},
 };
 
+struct trace_record {
+  uint32_t sec;  // Kernel timestamp of the event
+  uint32_t usec;
+  int32_t value;
+  uint16_t type;
+  uint16_t code;
+  uint16_t keyboard;  // Index into capsule.keyboards
+  uint16_t reserved;
+};
+_Static_assert(sizeof(struct trace_record) == 20, "Trace records must stay compact");
+
+// Events read and written, as logged with --debug. Formatting them is left for when we're idle.
+struct event_log_record {
+  uint64_t time_ns;  // CLOCK_MONOTONIC
+  int32_t value;
+  uint16_t type;
+  uint16_t code;
+  uint16_t keyboard;  // Index into capsule.keyboards
+  char direction;  // 'R' for read from the keyboard, 'W' for written to uinput
+};
+
+// Keys pressed together, all within the combo term, that trigger an action instead
+struct combo {
+  uint16_t codes[MAX_COMBO_LENGTH];
+  size_t length;
+  struct action action;
+};
+
+// Key taps and delays, compiled into the events to write to uinput. A delay is an event of type
+// MACRO_EVENT_DELAY, with the number of milliseconds as value.
+struct macro {
+  uint32_t first_event;  // Index into keymap->macro_events
+  uint32_t num_events;
+};
+
+// Actions compiled into a lookup by layer and key code. Everything the event path reads is in the
+// same allocation, with the layers' action_index_by_code first so that the entries for the letter
+// keys of a layer share a couple cache lines.
+struct keymap {
+  size_t num_layers;
+  uint32_t layers_mask;  // Bits of the layers that exist
+  bool uses_mouse;  // Has mouse actions, so the mouse device is needed
+  size_t num_actions;
+  struct action* actions;  // Right after the macros
+
+  size_t num_macros;
+  struct macro* macros;  // Right after macro_events
+  size_t num_macro_events;
+  struct input_event* macro_events;  // Right after the combos
+
+  // Each key used in combos has a bit, and combos are matched on masks of those. Checking which
+  // combos pressed keys could still be part of is an AND of their combos_by_key.
+  size_t num_combos;
+  struct combo* combos;  // Right after combo_keys
+  uint64_t* combo_keys;  // Mask of each combo's keys; right after the layers
+  uint8_t combo_key_by_code[KEY_CNT];  // NO_COMBO_KEY for keys not in any combo
+  uint64_t combos_by_key[MAX_NUM_COMBO_KEYS][BITSET_NUM_WORDS(MAX_NUM_COMBOS)];
+
+  uint16_t action_index_by_code[][KEY_CNT];  // Per layer; NO_ACTION for keys without an action
+};
+
+// Keyboards register more than one fd with epoll, each with a pointer to one of these as data
+enum keyboard_fd_kind {
+  KEYBOARD_FD_EVDEV = 1,
+  KEYBOARD_FD_TIMER,
+};
+
+enum tap_hold_policy {
+  // Caps Lock acts as a modifier as soon as another key is pressed while it's held
+  TAP_HOLD_POLICY_HOLD_ON_OTHER_KEY_PRESS,
+  // Caps Lock acts as a modifier only if another key is both pressed and released while it's held,
+  // or if it's held for the tapping term; a key pressed before that is held back until decided
+  TAP_HOLD_POLICY_PERMISSIVE_HOLD,
+};
+
+// Open addressing hash table with linear probing, so that finding keyboards on hotplug stays cheap
+// no matter how many there are
+struct keyboard_table {
+  struct keyboard_table_entry {
+    uint64_t key;  // Inode, or hash of the name
+    struct keyboard* keyboard;  // NULL if the entry is free
+  }* entries;
+  size_t mask;  // Number of entries minus one, which is a power of two
+  size_t num_keyboards;
+};
+
+struct latency_histogram {
+  uint64_t num_samples;
+  uint64_t max_ns;
+  uint32_t buckets[LATENCY_NUM_BUCKETS];
+};
+
+// Counters, as mapped to STATS_FILE_PATH. Readers copy what they need, and retry if sequence was
+// odd before, or different after; it's odd while publish_stats() updates the page.
+struct stats_page {
+  char magic[16];  // STATS_FILE_MAGIC
+  uint64_t sequence;
+  uint64_t num_events_in;
+  uint64_t num_events_out;
+  uint64_t num_resyncs;
+  uint64_t num_keyboards_added;
+  uint64_t num_keyboards_removed;
+  uint32_t num_keyboards;  // Slots used so far; those with inode 0 are free
+  uint32_t num_actions;  // In the keymap; hits are there for the first STATS_MAX_NUM_ACTIONS
+  struct stats_keyboard {
+    uint64_t inode;
+    uint64_t num_events_in;
+    uint64_t num_events_out;
+    uint64_t num_resyncs;
+    uint64_t num_debounced;
+    char name[NAME_MAX + 1];  // Entry in INPUT_DEVICE_PATH
+    struct latency_histogram latency;  // Buckets as by latency_bucket_upper_bound()
+  } keyboards[STATS_MAX_NUM_KEYBOARDS];
+  uint64_t action_hits[STATS_MAX_NUM_ACTIONS];
+};
+
 static struct {
   DIR* dev_dirp;  // Base dir of where we find/monitor for keyboard devices
-  int inotify_fd;
+  int epoll_fd;  // Keyboards register with pointers to their enum keyboard_fd_kind members
+  int inotify_fd;  // Registered with &capsule.inotify_fd as data pointer
   int inotify_wd;
+  int signal_fd;  // Registered with &capsule.signal_fd as data pointer
+
+  int udev_inotify_fd;  // Watches UDEV_DATA_PATH; registered with its address. -1 without udev
+
+  const char* config_path;  // NULL if using the built-in action_table
+  int config_inotify_fd;  // Watches the config file's directory; registered with its address
+
+  // With --control-socket, each client that connects gets a snapshot of the counters, and is then
+  // disconnected. Clients are never waited for, so they can't hold up the keyboards.
+  struct {
+    const char* path;  // NULL if disabled
+    int fd;  // Listening; registered with &capsule.control.fd as data pointer
+  } control;
 
   bool swap_caps_lock_and_escape;
 
+  // With --merged-output, keyboards that fit share this uinput device instead of getting one each
+  struct {
+    bool enabled;
+    struct libevdev* dev;
+    struct libevdev_uinput* uinput_dev;  // NULL when replaying traces
+    uint16_t num_holders[KEY_CNT];  // Keyboards holding each key down on it
+  } merged_output;
+
+  // Pointer device for the mouse actions, shared by all keyboards. While motion keys are held, the
+  // timer ticks every MOUSE_TICK_MS, with the pointer speed going from start_speed to max_speed
+  // over acceleration_ns as (time held / acceleration_ns)^curve_exponent.
+  struct {
+    struct libevdev* dev;
+    struct libevdev_uinput* uinput_dev;  // NULL when replaying traces
+    int timer_fd;  // Registered with its address; disarmed while not moving
+    uint16_t num_holds[MOUSE_NUM_MOTIONS];  // Keys held for each motion
+    uint64_t start_ns;  // When motion started
+    uint64_t next_tick_ns;  // 0 while not moving
+    double remainders[REL_CNT];  // Fractions of units moved but not sent, by REL_ code
+    unsigned int start_speed;  // Pixels per second
+    unsigned int max_speed;
+    uint64_t acceleration_ns;
+    unsigned int curve_exponent;
+  } mouse;
+
+  bool bulk_read;  // read() events straight from the evdev fd instead of through libevdev
+
+  struct {
+    enum tap_hold_policy policy;
+    uint64_t tapping_term_ns;  // Caps Lock held this long acts as a modifier; 0 for no limit
+  } tap_hold;
+
+  uint64_t combo_term_ns;
+
+  struct key_repeat key_repeat;  // By --key-repeat, for key actions without REPEAT(...)
+
+  // Debounce thresholds, by --debounce. The first rule naming a keyboard, by its entry in
+  // INPUT_DEVICE_PATH or by its device name, is used for it; other keyboards get default_ns.
+  struct {
+    uint64_t default_ns;  // 0 to not debounce
+    struct debounce_rule {
+      const char* device;
+      uint64_t threshold_ns;
+    } rules[MAX_NUM_DEBOUNCE_RULES];
+    size_t num_rules;
+  } debounce;
+
+  struct {
+    bool enabled;
+    int priority;
+    int cpu;  // -1 to not pin
+  } realtime;
+
+  FILE* trace_file;  // If set, all events read from keyboards are recorded here
+
+  // When replaying a trace, uinput output is appended here instead of written to a device
+  struct {
+    bool active;
+    struct trace_record* output;
+    size_t num_output;
+    size_t output_capacity;
+  } replay;
+
+  // Ring of logged events. Filled on the event path and drained before blocking in epoll_wait(),
+  // and the oldest records are kept if it overflows. Free-running indices.
+  struct {
+    struct event_log_record records[EVENT_LOG_NUM_RECORDS];
+    uint32_t head;  // Next record to write
+    uint32_t tail;  // Next record to print
+    uint64_t num_dropped;  // Since the last drain
+    uint64_t total_num_dropped;
+  } event_log;
+
+  const struct keymap* keymap;  // Never modified once compiled, but replaced on reload
+
+  // Kernel timestamp to uinput write, for frames where the keymap action was used
+  struct latency_histogram* action_latency;  // keymap->num_actions entries
+  uint64_t* action_hits;  // Key presses that used each keymap action
+
+  // Counters of keyboards that have been closed, so that the totals don't go down on unplug
+  struct {
+    uint64_t num_events_in;
+    uint64_t num_events_out;
+    uint64_t num_resyncs;
+  } closed_keyboards_stats;
+  uint64_t num_keyboards_added;  // Set up, at start or when plugged in
+  uint64_t num_keyboards_removed;
+
+  struct stats_page* stats_page;  // NULL if STATS_FILE_PATH couldn't be set up
+  bool stats_page_outdated;  // In ways that the keyboard counters don't show, like by a reload
+
   struct keyboard {
+    enum keyboard_fd_kind evdev_fd_kind;  // Always KEYBOARD_FD_EVDEV
+
     struct {
       bool grabbed;
+      bool grab_failed;
+      uint64_t grab_deadline_ns;  // Grab by then even if the uinput device doesn't seem ready
       bool caps_lock_pressed;
 
-      bool key_pressed_while_caps_lock_pressed;
-      bool action_table_activated[ARRAY_SIZE(action_table)];
+      // Physical key state, kept here since libevdev doesn't see events with --bulk-read
+      uint64_t keys_down[BITSET_NUM_WORDS(KEY_CNT)];
+      bool dropping_events;  // Skipping the rest of a frame after SYN_DROPPED
+
+      // Tap or hold of Caps Lock is undecided while it's pressed and this is false
+      bool caps_lock_is_modifier;
+      uint64_t tap_hold_deadline_ns;  // Event time at which Caps Lock becomes a modifier, or 0
+      bool has_held_back_press;
+      struct input_event held_back_press;  // Key pressed while undecided; permissive hold only
+
+      uint64_t action_activated[BITSET_NUM_WORDS(KEY_CNT)];  // Indexed by key code
+
+      // Copies of the actions that pressed the activated keys, so that repeats and releases go
+      // through the same action even if the layers or the keymap have changed since
+      struct action activated_actions[KEY_CNT];
+      // Indices into keymap->actions of the activated actions, for latency statistics. NO_ACTION
+      // once the keymap is replaced, since the indices are then for other actions.
+      uint16_t activated_action_indices[KEY_CNT];
+
+      uint32_t momentary_layers;  // Layers with momentary keys held
+      uint16_t num_momentary_holds[MAX_NUM_LAYERS];
+      uint32_t toggled_layers;
+      uint32_t one_shot_layers;  // Active until another key is pressed
+
+      // Presses of keys that may be part of a combo are held back until it's clear whether they
+      // are, with the deadline for the combo term armed
+      struct input_event combo_presses[MAX_COMBO_LENGTH];
+      size_t num_combo_presses;
+      uint64_t combo_press_keys;  // Combo key bits of combo_presses
+      uint64_t combo_candidates[BITSET_NUM_WORDS(MAX_NUM_COMBOS)];  // Could still match
+      uint64_t combo_deadline_ns;  // Event time, or 0
+
+      // Combos whose keys are held; the first release of any of the keys releases the action
+      struct fired_combo {
+        struct action action;
+        uint16_t codes[MAX_COMBO_LENGTH];  // Held keys; KEY_RESERVED for released ones
+        bool released;
+      } fired_combos[MAX_NUM_FIRED_COMBOS];
+      size_t num_fired_combos;
+
+      // Macro being played. Its events are written up until the next delay, and the rest is left
+      // for the timer, so that long macros don't hold up other keyboards.
+      const struct input_event* macro_next;  // Into keymap->macro_events; NULL if none is playing
+      const struct input_event* macro_end;
+      uint64_t macro_deadline_ns;  // Time to continue, or 0
+
+      // Key whose action capsule repeats. Like the kernel does, only the last key pressed repeats,
+      // and it stops when another key is pressed. The deadlines are at fixed multiples of the
+      // period from the first repeat, so that the pace doesn't drift.
+      uint16_t repeat_code;  // KEY_RESERVED if none
+      uint32_t repeat_layers;  // Active when the key was pressed; repeating stops if they change
+      uint64_t repeat_start_ns;  // Time of the first repeat
+      uint64_t num_repeats;
+      uint64_t repeat_deadline_ns;  // Time of the next repeat, or 0
+
+      uint64_t time_ns;  // Of the event, or deadline, being handled
     } state;
 
+    // Chatter filter, run on events before handle_input_event(). An edge of a key is passed on
+    // right away, and edges that follow within threshold_ns are dropped. Once that's passed, a key
+    // whose last edge was dropped is brought in line with it.
+    struct {
+      uint64_t threshold_ns;  // 0 to not filter
+      uint64_t settle_ns[KEY_CNT];  // When the last edge passed on stops dropping, by key code
+      uint64_t keys_down[BITSET_NUM_WORDS(KEY_CNT)];  // As passed on
+      uint64_t unsettled_keys[BITSET_NUM_WORDS(KEY_CNT)];  // Edges dropped since the last passed on
+      uint64_t pending_keys_down[BITSET_NUM_WORDS(KEY_CNT)];  // Last dropped edges
+      uint64_t deadline_ns;  // When the first unsettled key is settled, or 0
+      bool dropped_in_report;  // To not pass on a SYN_REPORT that would be empty
+      bool passed_in_report;
+    } debounce;
+
+    // Events to send to uinput; written with a single write() once a SYN_REPORT is queued
+    struct {
+      struct input_event events[OUTPUT_BUFFER_MAX_NUM_EVENTS];
+      size_t num_events;
+      uint64_t keys_down[BITSET_NUM_WORDS(KEY_CNT)];  // Only tracked with --merged-output
+    } output;
+
+    struct {
+      uint64_t num_events_in;
+      uint64_t num_events_out;  // Written to uinput
+      uint64_t num_resyncs;  // Times the kernel dropped events and we had to catch up
+      uint64_t num_debounced;  // Key events dropped as chatter
+    } stats;
+
+    struct {
+      struct latency_histogram histogram;  // Kernel timestamp to uinput write, per frame
+      bool frame_used_action;
+      size_t frame_action;  // Index into keymap->actions, if frame_used_action
+    } latency;
+
+    // Armed, with an absolute CLOCK_MONOTONIC time, for the earliest of the keyboard's deadlines
+    struct {
+      enum keyboard_fd_kind fd_kind;  // Always KEYBOARD_FD_TIMER
+      int fd;  // -1 when replaying traces, in which case time is only driven by events
+      uint64_t armed_ns;  // 0 if disarmed
+    } timer;
+
+    char name[NAME_MAX + 1];  // Entry in INPUT_DEVICE_PATH
     ino_t inode;
     int event_fd;
     struct libevdev* dev;
-    struct libevdev_uinput* uinput_dev;
-  } keyboards[16];  // Should be enough for anybody
+    struct libevdev_uinput* uinput_dev;  // Possibly capsule.merged_output.uinput_dev
+
+    bool in_use;  // Not in capsule.unused_keyboards
+    bool marked_for_deletion;  // Used by scan_keyboards()
+    size_t index;  // Into capsule.keyboards; kept by reset_keyboard()
+  }** keyboards;  // Never freed or moved before exit, since epoll may still return their fds
+  size_t num_keyboards;
+  size_t keyboards_capacity;
+
+  struct keyboard** unused_keyboards;  // Closed keyboards, to reuse before allocating new ones
+  size_t num_unused_keyboards;
+
+  // Keyboards that are set up, for finding them as their entries come and go
+  struct keyboard_table keyboard_by_inode;
+  struct keyboard_table keyboard_by_name;
+
+  size_t num_pending_grabs;  // Set up keyboards that are neither grabbed nor failed to grab
 } capsule;
 
-#define POLLFDS_MAX_NUM_FDS (ARRAY_SIZE(capsule.keyboards) + 1 /*inotify_fd*/)
+#define NO_ACTION UINT16_MAX
+#define NO_COMBO_KEY UINT8_MAX
+#define NO_LAYER UINT8_MAX
+#define MACRO_EVENT_DELAY EV_CNT  // Not an event type the kernel knows
+#define REPLAY_MOUSE_OUTPUT UINT16_MAX  // In place of a keyboard index, for replayed mouse events
 
 #define FOR_EACH_KEYBOARD(kbd) \
-  for (struct keyboard* kbd = &capsule.keyboards[0]; \
-       kbd < &capsule.keyboards[ARRAY_SIZE(capsule.keyboards)]; \
-       ++kbd)
+  for (size_t kbd##_index = 0; kbd##_index < capsule.num_keyboards; ++kbd##_index) \
+    for (struct keyboard* kbd = capsule.keyboards[kbd##_index]; kbd; kbd = NULL)
 
-static void close_keyboard(struct keyboard* keyboard)
+static uint64_t now_ns(void)
 {
-  if (keyboard->inode > 0) {
-    DEBUG("ino=%ju", (uintmax_t)keyboard->inode);
-  }
-
-  if (keyboard->dev) {
-    if (keyboard->state.grabbed) {
-      libevdev_grab(keyboard->dev, LIBEVDEV_UNGRAB);
-    }
-    close(libevdev_get_fd(keyboard->dev));
-    libevdev_free(keyboard->dev);
-  }
-  if (keyboard->uinput_dev) {
-    libevdev_uinput_destroy(keyboard->uinput_dev);
-  }
-
-  if (keyboard->event_fd >= 0) {
-    close(keyboard->event_fd);
-  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-  memset(keyboard, 0, sizeof(*keyboard));
-  keyboard->event_fd = -1;
+static bool bitset_test(const uint64_t* bitset, unsigned int bit)
+{
+  return (bitset[bit / 64] >> (bit % 64)) & 1;
 }
 
-static bool init_capsule(void)
+static void bitset_assign(uint64_t* bitset, unsigned int bit, bool value)
 {
-  capsule.inotify_fd = -1;
-  capsule.inotify_wd = -1;
+  const uint64_t mask = UINT64_C(1) << (bit % 64);
+  bitset[bit / 64] = value ? (bitset[bit / 64] | mask) : (bitset[bit / 64] & ~mask);
+}
 
-  FOR_EACH_KEYBOARD (keyboard) {
-    close_keyboard(keyboard);
+static void log_event(const struct keyboard* keyboard,
+                      char direction,
+                      uint64_t time_ns,
+                      unsigned int type,
+                      unsigned int code,
+                      int value)
+{
+  if (capsule.event_log.head - capsule.event_log.tail == EVENT_LOG_NUM_RECORDS) {
+    capsule.event_log.num_dropped++;
+    return;
   }
 
-  capsule.dev_dirp = opendir(INPUT_DEVICE_PATH);
-  if (!capsule.dev_dirp) {
-    ERROR("Couldn't open " INPUT_DEVICE_PATH ": %s", strerror(errno));
-    return false;
-  }
+  capsule.event_log.records[capsule.event_log.head++ % EVENT_LOG_NUM_RECORDS] =
+      (struct event_log_record){
+          .time_ns = time_ns,
+          .value = value,
+          .type = type,
+          .code = code,
+          .keyboard = keyboard->index,
+          .direction = direction,
+      };
+}
 
-  capsule.inotify_fd = inotify_init1(O_NONBLOCK);
-  if (capsule.inotify_fd == -1) {
-    ERROR("Couldn't open inotify fd: %s", strerror(errno));
-    return false;
+static void drain_event_log(void)
+{
+  while (capsule.event_log.tail != capsule.event_log.head) {
+    const struct event_log_record* record =
+        &capsule.event_log.records[capsule.event_log.tail++ % EVENT_LOG_NUM_RECORDS];
+    printf("Debug [%u]: %c Event: %s %s %d @%ju.%06ju\n",
+           record->keyboard,
+           record->direction,
+           libevdev_event_type_get_name(record->type),
+           libevdev_event_code_get_name(record->type, record->code),
+           record->value,
+           (uintmax_t)(record->time_ns / 1000000000),
+           (uintmax_t)(record->time_ns % 1000000000 / 1000));
   }
 
-  capsule.inotify_wd =
-      inotify_add_watch(capsule.inotify_fd, INPUT_DEVICE_PATH, IN_CREATE | IN_DELETE);
-  if (capsule.inotify_wd == -1) {
-    ERROR("inotify_add_watch failed: %s", strerror(errno));
-    return false;
+  if (capsule.event_log.num_dropped > 0) {
+    printf("Debug: %ju events not logged; the log was full\n",
+           (uintmax_t)capsule.event_log.num_dropped);
+    capsule.event_log.total_num_dropped += capsule.event_log.num_dropped;
+    capsule.event_log.num_dropped = 0;
   }
-
-  return true;
 }
 
-static struct keyboard* find_keyboard_by_inode(ino_t inode)
+static bool is_layer_action(const struct action* action)
 {
-  FOR_EACH_KEYBOARD (keyboard) {
-    if (keyboard->inode == inode) {
-      return keyboard;
-    }
-  }
-  return NULL;
+  return action->kind == ACTION_KIND_MOMENTARY_LAYER || action->kind == ACTION_KIND_TOGGLE_LAYER
+         || action->kind == ACTION_KIND_ONE_SHOT_LAYER;
 }
 
-static struct keyboard* find_free_keyboard_struct(void)
+static bool is_mouse_action(const struct action* action)
 {
-  FOR_EACH_KEYBOARD (keyboard) {
-    if (!keyboard->dev) {
-      assert(!keyboard->uinput_dev);
-      return keyboard;
-    }
-  }
-  return NULL;
+  return action->kind == ACTION_KIND_MOUSE_MOTION || action->kind == ACTION_KIND_MOUSE_BUTTON;
 }
 
-static bool setup_keyboard(struct keyboard* keyboard, DIR* base_dirp, struct dirent* dirent)
+static struct keymap* compile_keymap(const struct action* actions,
+                                     size_t num_actions,
+                                     const struct combo* combos,
+                                     size_t num_combos,
+                                     const struct macro* macros,
+                                     size_t num_macros,
+                                     const struct input_event* macro_events,
+                                     size_t num_macro_events)
 {
-  DEBUG("%s (ino=%ju)", dirent->d_name, (uintmax_t)dirent->d_ino);
-  keyboard->event_fd = openat(dirfd(base_dirp), dirent->d_name, O_RDONLY | O_NONBLOCK);
-  if (keyboard->event_fd == -1) {
-    ERROR("Couldn't open %s: %s", dirent->d_name, strerror(errno));
-    goto done;
+  if (num_actions >= NO_ACTION) {
+    ERROR("Too many actions (%zu)", num_actions);
+    return NULL;
   }
-
-  keyboard->dev = libevdev_new();
-  assert(keyboard->dev);  // Weird enough that it's worth getting a crash to know
-
-  if (log_level == LOG_LEVEL_DEBUG) {
-    // TODO: Implement installing of libevdev log callbacks here
-  }
-
-  keyboard->inode = dirent->d_ino;
-
-  int rc = libevdev_set_fd(keyboard->dev, keyboard->event_fd);
-  if (rc < 0) {
-    ERROR("Couldn't set fd for device %s: %s", dirent->d_name, strerror(-rc));
-    goto done;
+  if (num_combos > MAX_NUM_COMBOS) {
+    ERROR("Too many combos (%zu)", num_combos);
+    return NULL;
   }
-
-  rc = libevdev_uinput_create_from_device(
-      keyboard->dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &keyboard->uinput_dev);
-  if (rc < 0) {
-    ERROR("Failed creating uinput device: %s", strerror(-rc));
+  if (num_macros > UINT16_MAX) {
+    ERROR("Too many macros (%zu)", num_macros);
+    return NULL;
   }
 
-done:
-  if (!keyboard->uinput_dev) {
-    close_keyboard(keyboard);
+  size_t num_layers = CAPS_LOCK_LAYER + 1;
+  bool uses_mouse = false;
+  for (size_t i = 0; i < num_actions; i++) {
+    assert(actions[i].layer < MAX_NUM_LAYERS && actions[i].output.layer < MAX_NUM_LAYERS);
+    num_layers = actions[i].layer >= num_layers ? actions[i].layer + 1u : num_layers;
+    if (is_layer_action(&actions[i]) && actions[i].output.layer >= num_layers) {
+      num_layers = actions[i].output.layer + 1u;
+    }
+    uses_mouse |= is_mouse_action(&actions[i]);
   }
 
-  return keyboard->uinput_dev;
-}
-
-static bool scan_keyboards(void)
-{
-  bool marked_for_deletion[ARRAY_SIZE(capsule.keyboards)] = {false};
-
-  FOR_EACH_KEYBOARD (keyboard) {
-    marked_for_deletion[keyboard - capsule.keyboards] = (keyboard->dev != NULL);
+  for (size_t i = 0; i < num_combos; i++) {
+    const struct action* action = &combos[i].action;
+    if (is_layer_action(action) && action->output.layer >= num_layers) {
+      num_layers = action->output.layer + 1u;
+    }
+    uses_mouse |= is_mouse_action(action);
   }
 
-  rewinddir(capsule.dev_dirp);
+  const size_t layers_size = num_layers * KEY_CNT * sizeof(uint16_t);
+  const size_t combo_keys_size = num_combos * sizeof(uint64_t);
+  const size_t combos_size = num_combos * sizeof(struct combo);
+  const size_t macro_events_size = num_macro_events * sizeof(struct input_event);
+  const size_t macros_size = num_macros * sizeof(struct macro);
+  const size_t actions_size = num_actions * sizeof(struct action);
+  struct keymap* keymap = malloc(sizeof(*keymap) + layers_size + combo_keys_size + combos_size
+                                 + macro_events_size + macros_size + actions_size);
+  assert(keymap);
 
-  struct dirent* dirent;
-  while ((dirent = readdir(capsule.dev_dirp))) {
-    DEBUG("%s", dirent->d_name);
-    if (!strstr(dirent->d_name, "event-kbd")) {
-      continue;
+  keymap->num_layers = num_layers;
+  keymap->uses_mouse = uses_mouse;
+  keymap->layers_mask = num_layers == 32 ? UINT32_MAX : (UINT32_C(1) << num_layers) - 1;
+  for (size_t layer = 0; layer < num_layers; layer++) {
+    for (size_t code = 0; code < KEY_CNT; code++) {
+      keymap->action_index_by_code[layer][code] = NO_ACTION;
     }
+  }
 
-    struct keyboard* keyboard = find_keyboard_by_inode(dirent->d_ino);
-    if (keyboard) {
-      marked_for_deletion[keyboard - capsule.keyboards] = false;
-      continue;
+  keymap->num_actions = num_actions;
+  keymap->combo_keys = (uint64_t*)((char*)keymap->action_index_by_code + layers_size);
+  keymap->combos = (struct combo*)(keymap->combo_keys + num_combos);
+  keymap->macro_events = (struct input_event*)((char*)keymap->combos + combos_size);
+  keymap->macros = (struct macro*)(keymap->macro_events + num_macro_events);
+  keymap->actions = (struct action*)(keymap->macros + num_macros);
+  for (size_t i = 0; i < num_actions; i++) {
+    keymap->actions[i] = actions[i];
+    if (actions[i].kind == ACTION_KIND_KEY && actions[i].repeat.rate == 0) {
+      keymap->actions[i].repeat = capsule.key_repeat;
     }
 
-    keyboard = find_free_keyboard_struct();
-    assert(keyboard);
-
-    if (!setup_keyboard(keyboard, capsule.dev_dirp, dirent)) {
-      ERROR("Couldn't set-up keyboard %s", dirent->d_name);
+    const uint16_t code = actions[i].code;
+    assert(code < KEY_CNT);
+    uint16_t* index = &keymap->action_index_by_code[actions[i].layer][code];
+    if (*index == NO_ACTION) {  // First entry wins, as in a scan
+      *index = i;
     }
   }
 
-  size_t num_keyboards_setup = 0;
-  FOR_EACH_KEYBOARD (keyboard) {
-    if (marked_for_deletion[keyboard - capsule.keyboards]) {
-      close_keyboard(keyboard);
+  keymap->num_combos = num_combos;
+  memset(keymap->combo_key_by_code, NO_COMBO_KEY, sizeof(keymap->combo_key_by_code));
+  memset(keymap->combos_by_key, 0, sizeof(keymap->combos_by_key));
+  size_t num_combo_keys = 0;
+  for (size_t i = 0; i < num_combos; i++) {
+    keymap->combos[i] = combos[i];
+    keymap->combo_keys[i] = 0;
+    for (size_t j = 0; j < combos[i].length; j++) {
+      uint8_t* key = &keymap->combo_key_by_code[combos[i].codes[j]];
+      if (*key == NO_COMBO_KEY) {
+        if (num_combo_keys == MAX_NUM_COMBO_KEYS) {
+          ERROR("Too many keys in combos");
+          free(keymap);
+          return NULL;
+        }
+        *key = num_combo_keys++;
+      }
+      keymap->combo_keys[i] |= UINT64_C(1) << *key;
+      bitset_assign(keymap->combos_by_key[*key], i, true);
     }
-    num_keyboards_setup += (keyboard->dev != NULL);
   }
 
-  return num_keyboards_setup > 0;
-}
+  keymap->num_macros = num_macros;
+  keymap->num_macro_events = num_macro_events;
+  if (num_macros > 0) {
+    memcpy(keymap->macros, macros, macros_size);
+  }
+  if (num_macro_events > 0) {
+    memcpy(keymap->macro_events, macro_events, macro_events_size);
+  }
 
-static void write_event_to_uinput(struct libevdev_uinput* uinput_dev,
-                                  unsigned int type,
-                                  unsigned int code,
-                                  int value)
-{
-  DEBUG("W Event: %s %s %d",
-        libevdev_event_type_get_name(type),
-        libevdev_event_code_get_name(type, code),
-        value);
-  libevdev_uinput_write_event(uinput_dev, type, code, value);
+  return keymap;
 }
 
-static void handle_input_event(struct keyboard* keyboard, struct input_event* ev)
+// Accepts both "KEY_H" and "H"
+static int parse_key_name(const char* name)
 {
-  if (ev->type != EV_KEY) {
-    goto forward_event;
-  }
-
-  if (capsule.swap_caps_lock_and_escape && ev->code == KEY_ESC) {
-    ev->code = KEY_CAPSLOCK;
-    goto forward_event;
+  if (strncmp(name, "KEY_", 4) == 0) {
+    return libevdev_event_code_from_name(EV_KEY, name);
   }
 
-  if (ev->code == KEY_CAPSLOCK) {
-    if (ev->value > 1) {  // Key repeat
-      keyboard->state.key_pressed_while_caps_lock_pressed = true;
-      return;
-    }
-    else if (ev->value == 1) {
-      keyboard->state.caps_lock_pressed = true;
-      keyboard->state.key_pressed_while_caps_lock_pressed = false;
-      return;
-    }
-
-    keyboard->state.caps_lock_pressed = false;
-    if (keyboard->state.key_pressed_while_caps_lock_pressed) {
-      return;
-    }
-
-    const unsigned int key = capsule.swap_caps_lock_and_escape ? KEY_ESC : KEY_CAPSLOCK;
-    write_event_to_uinput(keyboard->uinput_dev, EV_KEY, key, 1);
-    write_event_to_uinput(keyboard->uinput_dev, EV_KEY, EV_SYN, 0);
-    write_event_to_uinput(keyboard->uinput_dev, EV_KEY, key, 0);
-    return;
+  char key_name[64];
+  if (snprintf(key_name, sizeof(key_name), "KEY_%s", name) >= (int)sizeof(key_name)) {
+    return -1;
   }
+  return libevdev_event_code_from_name(EV_KEY, key_name);
+}
 
-  for (size_t i = 0; i < ARRAY_SIZE(action_table); i++) {
-    if (action_table[i].code != ev->code) {
-      continue;
+// Parses the output of a rule, like "SHIFT+7", into action->output
+static bool parse_action_output(char* output, struct action* action)
+{
+  char* saveptr;
+  char* token = strtok_r(output, "+", &saveptr);
+  while (token) {
+    char* next = strtok_r(NULL, "+", &saveptr);
+    if (!next) {  // Last token is the key, the others modifiers
+      const int code = parse_key_name(token);
+      if (code < 0) {
+        ERROR("Unknown key '%s'", token);
+        return false;
+      }
+      action->output.code = code;
+      return true;
     }
 
-    // From this line on, we have a match, but first handle some cases where we back off
-    if (ev->value == 1 && !keyboard->state.caps_lock_pressed) {
-      goto forward_event;  // Key was pressed "normally", without caps lock held in
+    if (strcmp(token, "SHIFT") == 0 || strcmp(token, "LEFTSHIFT") == 0) {
+      action->output.shift = true;
     }
-
-    if (ev->value != 1 && !keyboard->state.action_table_activated[i]) {
-      goto forward_event;  // Key was pressed while caps lock wasn't held, so treat normally
+    else if (strcmp(token, "ALT") == 0 || strcmp(token, "LEFTALT") == 0) {
+      action->output.left_alt = true;
     }
-
-    // From here on, we know we should do something
-    if (action_table[i].output.right_alt && ev->value <= 1) {
-      write_event_to_uinput(keyboard->uinput_dev, EV_KEY, KEY_RIGHTALT, ev->value);
+    else if (strcmp(token, "ALTGR") == 0 || strcmp(token, "RIGHTALT") == 0) {
+      action->output.right_alt = true;
     }
-    if (action_table[i].output.left_ctrl && ev->value <= 1) {
-      write_event_to_uinput(keyboard->uinput_dev, EV_KEY, KEY_LEFTCTRL, ev->value);
+    else if (strcmp(token, "CTRL") == 0 || strcmp(token, "LEFTCTRL") == 0) {
+      action->output.left_ctrl = true;
     }
-    if (action_table[i].output.shift && ev->value <= 1) {
-      write_event_to_uinput(keyboard->uinput_dev, EV_KEY, KEY_LEFTSHIFT, ev->value);
+    else {
+      ERROR("Unknown modifier '%s'", token);
+      return false;
     }
-    write_event_to_uinput(keyboard->uinput_dev, EV_KEY, action_table[i].output.code, ev->value);
+    token = next;
+  }
 
-    // Something was done, and that's worth book keeping
-    if (ev->value <= 1) {
-      const bool activated = (ev->value == 1 && keyboard->state.caps_lock_pressed);
-      keyboard->state.action_table_activated[i] = activated;
-      keyboard->state.key_pressed_while_caps_lock_pressed |= activated;
-    }
+  ERROR("Missing output key");
+  return false;
+}
 
-    return;
+static char* trim_whitespace(char* str)
+{
+  while (isspace((unsigned char)*str)) {
+    str++;
   }
-
-  if (keyboard->state.caps_lock_pressed) {
-    keyboard->state.key_pressed_while_caps_lock_pressed |= ev->value == 1;
+  char* end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1])) {
+    *--end = '\0';
   }
-
-forward_event:
-  write_event_to_uinput(keyboard->uinput_dev, ev->type, ev->code, ev->value);
+  return str;
 }
 
-static bool is_killswitch_active(const struct libevdev* evdev)
+// Layer names can't be empty, or have brackets that would make them look like something else
+static bool is_valid_layer_name(const char* name)
 {
-  return libevdev_get_event_value(evdev, EV_KEY, KEY_LEFTCTRL) > 0
-         && libevdev_get_event_value(evdev, EV_KEY, KEY_RIGHTCTRL) > 0;
+  return *name != '\0' && !strpbrk(name, "[]()");
 }
 
-static void drain_inotify_events(void)
+// Returns the index of the named layer, adding it if it's new, or -1 if there are too many
+static int find_layer(char (*layer_names)[MAX_LAYER_NAME_LENGTH + 1],
+                      size_t* num_layers,
+                      const char* name)
 {
-  DEBUG();
-  for (;;) {
-    // As recommended in man inotify(7):
-    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
-    ssize_t len = read(capsule.inotify_fd, buf, ARRAY_SIZE(buf));
-    if (len <= 0) {
-      if (errno != EAGAIN) {
-        ERROR("read() gave error %s", strerror(errno));
-      }
-      break;
+  for (size_t i = 0; i < *num_layers; i++) {
+    if (strcmp(layer_names[i], name) == 0) {
+      return i;
     }
-
-    // We're not really interested in handling the exact events; we just want to know when it's time
-    // to rescan our watched directory (and thus the name of this method)
   }
+  if (*num_layers == MAX_NUM_LAYERS || strlen(name) > MAX_LAYER_NAME_LENGTH) {
+    return -1;
+  }
+  snprintf(layer_names[*num_layers], MAX_LAYER_NAME_LENGTH + 1, "%s", name);
+  return (*num_layers)++;
 }
 
-static size_t construct_pollfd_array(struct pollfd* pfds, size_t pfds_size)
+// Parses the output of a layer rule, like "MOMENTARY(NAV)"
+static bool parse_layer_action_output(char* output,
+                                      struct action* action,
+                                      char (*layer_names)[MAX_LAYER_NAME_LENGTH + 1],
+                                      size_t* num_layers)
 {
-  *pfds++ = (struct pollfd){.fd = capsule.inotify_fd, .events = POLLIN};
-  pfds_size--;
+  static const struct {
+    const char* name;
+    enum action_kind kind;
+  } kinds[] = {
+      {"MOMENTARY(", ACTION_KIND_MOMENTARY_LAYER},
+      {"TOGGLE(", ACTION_KIND_TOGGLE_LAYER},
+      {"ONESHOT(", ACTION_KIND_ONE_SHOT_LAYER},
+  };
 
-  size_t remaining = pfds_size;
-  FOR_EACH_KEYBOARD (keyboard) {
-    if (remaining == 0) {
-      ERROR("Bad sizing of pollfd array");
-      break;
+  const size_t length = strlen(output);
+  for (size_t i = 0; i < ARRAY_SIZE(kinds); i++) {
+    const size_t prefix_length = strlen(kinds[i].name);
+    if (strncmp(output, kinds[i].name, prefix_length) != 0 || output[length - 1] != ')') {
+      continue;
     }
 
-    const int fd = keyboard->dev ? libevdev_get_fd(keyboard->dev) : -1;
-    *pfds++ = (struct pollfd){.fd = fd, .events = POLLIN};
-    --remaining;
+    output[length - 1] = '\0';
+    const char* name = trim_whitespace(output + prefix_length);
+    if (!is_valid_layer_name(name)) {
+      ERROR("Bad layer name '%s'", name);
+      return false;
+    }
+    const int layer = find_layer(layer_names, num_layers, name);
+    if (layer < 0) {
+      ERROR("Too many layers, or too long name");
+      return false;
+    }
+    action->kind = kinds[i].kind;
+    action->output.layer = layer;
+    return true;
   }
-  return pfds_size - remaining;
+
+  ERROR("Unknown layer action '%s'", output);
+  return false;
 }
 
-struct keyboard* get_keyboard_from_pollfd(struct pollfd* pollfd_array, struct pollfd* pfd)
+static void append_macro_event(struct input_event** events,
+                               size_t* num_events,
+                               size_t* capacity,
+                               unsigned int type,
+                               unsigned int code,
+                               int value)
 {
-  return &capsule.keyboards[(pfd - pollfd_array) - 1];
+  if (*num_events == *capacity) {
+    *capacity *= 2;
+    *events = realloc(*events, *capacity * sizeof(**events));
+    assert(*events);
+  }
+  (*events)[(*num_events)++] = (struct input_event){.type = type, .code = code, .value = value};
 }
 
-static bool handle_keyboard_evdev_event(struct keyboard* keyboard)
+// Parses the output of a macro rule, like "MACRO(H I SHIFT+1 100MS ENTER)", into events appended
+// to *events. Each key combo is tapped, in a frame of its own for the press and the release, and
+// delays like 100MS pause the macro.
+static bool parse_macro_output(char* output,
+                               struct macro* macro,
+                               struct input_event** events,
+                               size_t* num_events,
+                               size_t* capacity)
 {
-  int rc;
-  do {
-    // Internally, libevdev caches events
-    struct input_event ev;
-    rc = libevdev_next_event(keyboard->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-    if (rc == 0) {
-      DEBUG("R Event: %s %s %d",
-            libevdev_event_type_get_name(ev.type),
-            libevdev_event_code_get_name(ev.type, ev.code),
-            ev.value);
-
-      if (is_killswitch_active(keyboard->dev)) {
-        ERROR("KILLSWITCH detected; exiting\n");
+  const size_t length = strlen(output);
+  if (strncmp(output, "MACRO(", 6) != 0 || output[length - 1] != ')') {
+    ERROR("Expected MACRO(...)");
+    return false;
+  }
+  output[length - 1] = '\0';
+
+  const size_t first_event = *num_events;
+  char* saveptr;
+  for (char* token = strtok_r(output + 6, " \t", &saveptr); token;
+       token = strtok_r(NULL, " \t", &saveptr)) {
+    if (isdigit((unsigned char)token[0])) {
+      char* end;
+      const unsigned long delay_ms = strtoul(token, &end, 10);
+      if (strcmp(end, "MS") != 0 || delay_ms > MAX_MACRO_DELAY_MS) {
+        ERROR("Bad delay '%s'; expected at most %dMS", token, MAX_MACRO_DELAY_MS);
         return false;
       }
+      append_macro_event(events, num_events, capacity, MACRO_EVENT_DELAY, 0, delay_ms);
+      continue;
+    }
 
-      handle_input_event(keyboard, &ev);
+    struct action step = {0};
+    if (!parse_action_output(token, &step)) {
+      return false;
     }
-    else if (rc == -ENODEV) {
+    const struct {
+      bool used;
+      unsigned int code;
+    } modifiers[] = {
+        {step.output.left_alt, KEY_LEFTALT},
+        {step.output.right_alt, KEY_RIGHTALT},
+        {step.output.left_ctrl, KEY_LEFTCTRL},
+        {step.output.shift, KEY_LEFTSHIFT},
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(modifiers); i++) {
+      if (modifiers[i].used) {
+        append_macro_event(events, num_events, capacity, EV_KEY, modifiers[i].code, 1);
+      }
+    }
+    append_macro_event(events, num_events, capacity, EV_KEY, step.output.code, 1);
+    append_macro_event(events, num_events, capacity, EV_SYN, SYN_REPORT, 0);
+    append_macro_event(events, num_events, capacity, EV_KEY, step.output.code, 0);
+    for (size_t i = ARRAY_SIZE(modifiers); i-- > 0;) {
+      if (modifiers[i].used) {
+        append_macro_event(events, num_events, capacity, EV_KEY, modifiers[i].code, 0);
+      }
+    }
+    append_macro_event(events, num_events, capacity, EV_SYN, SYN_REPORT, 0);
+  }
+
+  if (*num_events == first_event) {
+    ERROR("Empty macro");
+    return false;
+  }
+  macro->first_event = first_event;
+  macro->num_events = *num_events - first_event;
+  return true;
+}
+
+// Returns true if the output is one of mouse_outputs, which is then put in the action
+static bool parse_mouse_action_output(const char* output, struct action* action)
+{
+  for (size_t i = 0; i < ARRAY_SIZE(mouse_outputs); i++) {
+    if (strcmp(output, mouse_outputs[i].name) == 0) {
+      action->kind = mouse_outputs[i].kind;
+      action->output.code = mouse_outputs[i].code;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses "DELAY_MS,RATE" of key repeat settings
+static bool parse_key_repeat(const char* values, struct key_repeat* repeat)
+{
+  unsigned int delay_ms;
+  unsigned int rate;
+  int length = 0;
+  if (sscanf(values, "%u,%u%n", &delay_ms, &rate, &length) != 2 || values[length] != '\0'
+      || delay_ms > MAX_KEY_REPEAT_DELAY_MS || rate == 0 || rate > MAX_KEY_REPEAT_RATE) {
+    ERROR("Expected key repeat DELAY_MS,RATE, with DELAY_MS at most %d and RATE 1 to %d",
+          MAX_KEY_REPEAT_DELAY_MS,
+          MAX_KEY_REPEAT_RATE);
+    return false;
+  }
+  repeat->delay_ms = delay_ms;
+  repeat->rate = rate;
+  return true;
+}
+
+// Parses the keys of a combo rule, like "J+K"
+static bool parse_combo_keys(char* keys, struct combo* combo)
+{
+  char* saveptr;
+  for (char* token = strtok_r(keys, "+", &saveptr); token; token = strtok_r(NULL, "+", &saveptr)) {
+    const int code = parse_key_name(trim_whitespace(token));
+    if (code < 0) {
+      ERROR("Unknown key '%s'", token);
+      return false;
+    }
+    for (size_t i = 0; i < combo->length; i++) {
+      if (combo->codes[i] == code) {
+        ERROR("Key '%s' is in the combo twice", token);
+        return false;
+      }
+    }
+    if (combo->length == MAX_COMBO_LENGTH) {
+      ERROR("Combos can have at most %d keys", MAX_COMBO_LENGTH);
+      return false;
+    }
+    combo->codes[combo->length++] = code;
+  }
+
+  if (combo->length < 2) {
+    ERROR("Combos need at least two keys");
+    return false;
+  }
+  return true;
+}
+
+// Config files have one rule per line, "KEY = [MODIFIER+]...OUTPUT_KEY", e.g. "SLASH = SHIFT+7".
+// Key names are those of linux/input.h, with or without the KEY_ prefix. Everything after a '#' is
+// a comment.
+//
+// Rules are for the Caps Lock layer, until a "[LAYER]" line puts the rules after it in another one.
+// BASE is the layer at the bottom, always active. Other layers are activated by rules with
+// MOMENTARY(LAYER), TOGGLE(LAYER) or ONESHOT(LAYER) as output.
+//
+// Rules for combos, like "J+K = ESC", trigger when all their keys are pressed within the combo
+// term. They're in the BASE layer and only match when no other layer is active.
+//
+// Rules with MACRO(...) as output type a sequence of key combos and delays; see
+// parse_macro_output(). Outputs can also be any of mouse_outputs, to use the keys as a mouse.
+//
+// Rules of single keys with key outputs can end with "REPEAT(DELAY_MS,RATE)", for capsule to
+// repeat the output itself at that pace, like "H = LEFT REPEAT(200,40)".
+static struct keymap* load_config_file(const char* path)
+{
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    ERROR("Couldn't open %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  struct keymap* keymap = NULL;
+  size_t num_actions = 0;
+  size_t capacity = 64;
+  struct action* actions = malloc(capacity * sizeof(*actions));
+  assert(actions);
+  size_t num_combos = 0;
+  size_t combos_capacity = 16;
+  struct combo* combos = malloc(combos_capacity * sizeof(*combos));
+  assert(combos);
+  size_t num_macros = 0;
+  size_t macros_capacity = 16;
+  struct macro* macros = malloc(macros_capacity * sizeof(*macros));
+  assert(macros);
+  size_t num_macro_events = 0;
+  size_t macro_events_capacity = 256;
+  struct input_event* macro_events = malloc(macro_events_capacity * sizeof(*macro_events));
+  assert(macro_events);
+
+  char layer_names[MAX_NUM_LAYERS][MAX_LAYER_NAME_LENGTH + 1] = {"BASE", "CAPSLOCK"};
+  size_t num_layers = 2;
+  int layer = CAPS_LOCK_LAYER;
+
+  char* line = NULL;
+  size_t line_capacity = 0;
+  for (unsigned int line_number = 1; getline(&line, &line_capacity, file) != -1; line_number++) {
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    for (char* c = line; *c; c++) {
+      *c = toupper((unsigned char)*c);
+    }
+
+    char* key = trim_whitespace(line);
+    if (*key == '\0') {
+      continue;
+    }
+
+    const size_t length = strlen(key);
+    if (key[0] == '[' && key[length - 1] == ']') {
+      key[length - 1] = '\0';
+      const char* name = trim_whitespace(key + 1);
+      if (!is_valid_layer_name(name)) {
+        ERROR("%s:%u: Bad layer name '%s'", path, line_number, name);
+        goto done;
+      }
+      layer = find_layer(layer_names, &num_layers, name);
+      if (layer < 0) {
+        ERROR("%s:%u: Too many layers, or too long name", path, line_number);
+        goto done;
+      }
+      continue;
+    }
+
+    char* output = strchr(key, '=');
+    if (!output) {
+      ERROR("%s:%u: Expected KEY = OUTPUT", path, line_number);
+      goto done;
+    }
+    *output++ = '\0';
+    key = trim_whitespace(key);
+    output = trim_whitespace(output);
+
+    char* repeat = strstr(output, "REPEAT(");
+    if (repeat && repeat > output && isspace((unsigned char)repeat[-1])) {
+      *repeat = '\0';
+      output = trim_whitespace(output);
+      repeat += 7;
+      const size_t repeat_length = strlen(repeat);
+      if (repeat[repeat_length - 1] != ')') {
+        ERROR("%s:%u: Expected REPEAT(DELAY_MS,RATE) at the end", path, line_number);
+        goto done;
+      }
+      repeat[repeat_length - 1] = '\0';
+    }
+
+    struct action action = {.layer = layer};
+    struct combo combo = {0};
+    const bool is_combo = strchr(key, '+');
+    if (is_combo) {
+      if (layer != BASE_LAYER) {
+        ERROR("%s:%u: Combos must be in the BASE layer", path, line_number);
+        goto done;
+      }
+      if (!parse_combo_keys(key, &combo)) {
+        ERROR("%s:%u: Bad combo", path, line_number);
+        goto done;
+      }
+      action.code = combo.codes[0];
+    }
+    else {
+      const int code = parse_key_name(key);
+      if (code < 0) {
+        ERROR("%s:%u: Unknown key '%s'", path, line_number, key);
+        goto done;
+      }
+      action.code = code;
+    }
+
+    bool parsed;
+    if (strncmp(output, "MACRO(", 6) == 0) {
+      if (num_macros == macros_capacity) {
+        macros_capacity *= 2;
+        macros = realloc(macros, macros_capacity * sizeof(*macros));
+        assert(macros);
+      }
+      parsed = parse_macro_output(output,
+                                  &macros[num_macros],
+                                  &macro_events,
+                                  &num_macro_events,
+                                  &macro_events_capacity);
+      action.kind = ACTION_KIND_MACRO;
+      action.output.macro = num_macros++;
+    }
+    else if (strchr(output, '(')) {
+      parsed = parse_layer_action_output(output, &action, layer_names, &num_layers);
+    }
+    else if (!parse_mouse_action_output(output, &action)) {
+      parsed = parse_action_output(output, &action);
+    }
+    else {
+      parsed = true;
+    }
+    if (!parsed) {
+      ERROR("%s:%u: Bad output", path, line_number);
+      goto done;
+    }
+    if (repeat && (is_combo || action.kind != ACTION_KIND_KEY)) {
+      ERROR("%s:%u: Only rules of single keys with key outputs can repeat", path, line_number);
+      goto done;
+    }
+    if (repeat && !parse_key_repeat(repeat, &action.repeat)) {
+      ERROR("%s:%u: Bad key repeat", path, line_number);
+      goto done;
+    }
+
+    if (is_combo) {
+      if (num_combos == combos_capacity) {
+        combos_capacity *= 2;
+        combos = realloc(combos, combos_capacity * sizeof(*combos));
+        assert(combos);
+      }
+      combo.action = action;
+      combos[num_combos++] = combo;
+      continue;
+    }
+
+    if (num_actions == capacity) {
+      capacity *= 2;
+      actions = realloc(actions, capacity * sizeof(*actions));
+      assert(actions);
+    }
+    actions[num_actions++] = action;
+  }
+
+  keymap = compile_keymap(
+      actions, num_actions, combos, num_combos, macros, num_macros, macro_events, num_macro_events);
+  DEBUG("Loaded %zu actions, %zu combos and %zu macros from %s",
+        num_actions,
+        num_combos,
+        num_macros,
+        path);
+
+done:
+  free(line);
+  free(macro_events);
+  free(macros);
+  free(combos);
+  free(actions);
+  fclose(file);
+  return keymap;
+}
+
+static struct keymap* load_keymap(void)
+{
+  if (capsule.config_path) {
+    return load_config_file(capsule.config_path);
+  }
+
+  struct action actions[ARRAY_SIZE(action_table)];
+  for (size_t i = 0; i < ARRAY_SIZE(actions); i++) {
+    actions[i] = action_table[i];
+    actions[i].layer = CAPS_LOCK_LAYER;
+  }
+  return compile_keymap(actions, ARRAY_SIZE(actions), NULL, 0, NULL, 0, NULL, 0);
+}
+
+// Must be called between evdev frames, since frames may refer to actions by index
+static void install_keymap(struct keymap* keymap)
+{
+  free((struct keymap*)capsule.keymap);
+  free(capsule.action_latency);
+  free(capsule.action_hits);
+
+  capsule.keymap = keymap;
+  capsule.action_latency = calloc(keymap->num_actions, sizeof(capsule.action_latency[0]));
+  assert(capsule.action_latency || keymap->num_actions == 0);
+  capsule.action_hits = calloc(keymap->num_actions, sizeof(capsule.action_hits[0]));
+  assert(capsule.action_hits || keymap->num_actions == 0);
+  capsule.stats_page_outdated = true;
+
+  FOR_EACH_KEYBOARD (keyboard) {
+    keyboard->latency.frame_used_action = false;
+    memset(keyboard->state.activated_action_indices,
+           0xff,
+           sizeof(keyboard->state.activated_action_indices));
+  }
+}
+
+static uint64_t hash_name(const char* name)
+{
+  // FNV-1a
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char)*name) * UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+static size_t keyboard_table_home(const struct keyboard_table* table, uint64_t key)
+{
+  return (key * UINT64_C(0x9e3779b97f4a7c15)) >> 32 & table->mask;
+}
+
+// Finds the keyboard with the given key, and with the given name if that isn't NULL
+static struct keyboard* keyboard_table_find(const struct keyboard_table* table,
+                                            uint64_t key,
+                                            const char* name)
+{
+  if (!table->entries) {
+    return NULL;
+  }
+
+  for (size_t i = keyboard_table_home(table, key); table->entries[i].keyboard;
+       i = (i + 1) & table->mask) {
+    const struct keyboard_table_entry* entry = &table->entries[i];
+    if (entry->key == key && (!name || strcmp(entry->keyboard->name, name) == 0)) {
+      return entry->keyboard;
+    }
+  }
+  return NULL;
+}
+
+static bool keyboard_table_insert(struct keyboard_table* table,
+                                  uint64_t key,
+                                  struct keyboard* keyboard)
+{
+  // Kept at most half full
+  if (!table->entries || (table->num_keyboards + 1) * 2 > table->mask + 1) {
+    const size_t num_entries = table->entries ? (table->mask + 1) * 2 : 16;
+    struct keyboard_table old_table = *table;
+    table->entries = calloc(num_entries, sizeof(table->entries[0]));
+    if (!table->entries) {
+      *table = old_table;
+      return false;
+    }
+    table->mask = num_entries - 1;
+    table->num_keyboards = 0;
+
+    for (size_t i = 0; old_table.entries && i <= old_table.mask; i++) {
+      if (old_table.entries[i].keyboard) {
+        keyboard_table_insert(table, old_table.entries[i].key, old_table.entries[i].keyboard);
+      }
+    }
+    free(old_table.entries);
+  }
+
+  size_t i = keyboard_table_home(table, key);
+  while (table->entries[i].keyboard) {
+    i = (i + 1) & table->mask;
+  }
+  table->entries[i] = (struct keyboard_table_entry){.key = key, .keyboard = keyboard};
+  table->num_keyboards++;
+  return true;
+}
+
+static void keyboard_table_remove(struct keyboard_table* table,
+                                  uint64_t key,
+                                  const struct keyboard* keyboard)
+{
+  if (!table->entries) {
+    return;
+  }
+
+  size_t i = keyboard_table_home(table, key);
+  while (table->entries[i].keyboard != keyboard) {
+    if (!table->entries[i].keyboard) {
+      return;  // Not in the table
+    }
+    i = (i + 1) & table->mask;
+  }
+  table->num_keyboards--;
+
+  // Move back entries after it that would otherwise no longer be found, i.e. whose home isn't
+  // cyclically in (i, j]
+  for (size_t j = (i + 1) & table->mask; table->entries[j].keyboard; j = (j + 1) & table->mask) {
+    const size_t home = keyboard_table_home(table, table->entries[j].key);
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      table->entries[i] = table->entries[j];
+      i = j;
+    }
+  }
+  table->entries[i].keyboard = NULL;
+}
+
+static void reset_keyboard(struct keyboard* keyboard)
+{
+  const size_t index = keyboard->index;
+  memset(keyboard, 0, sizeof(*keyboard));
+  keyboard->index = index;
+  keyboard->event_fd = -1;
+  keyboard->timer.fd = -1;
+
+  // Kept valid even for closed keyboards, since epoll may already have returned their fds
+  keyboard->evdev_fd_kind = KEYBOARD_FD_EVDEV;
+  keyboard->timer.fd_kind = KEYBOARD_FD_TIMER;
+}
+
+// The output is the index of the keyboard whose uinput device the events are for, or
+// REPLAY_MOUSE_OUTPUT
+static void append_events_to_replay_output(uint16_t output,
+                                           const struct input_event* events,
+                                           size_t num_events)
+{
+  const size_t needed = capsule.replay.num_output + num_events;
+  if (needed > capsule.replay.output_capacity) {
+    const size_t capacity = needed * 2;
+    struct trace_record* output = realloc(capsule.replay.output, capacity * sizeof(*output));
+    assert(output);
+    capsule.replay.output = output;
+    capsule.replay.output_capacity = capacity;
+  }
+
+  for (size_t i = 0; i < num_events; i++) {
+    const struct input_event* ev = &events[i];
+    capsule.replay.output[capsule.replay.num_output++] = (struct trace_record){
+        .type = ev->type,
+        .code = ev->code,
+        .value = ev->value,
+        .keyboard = output,
+    };
+  }
+}
+
+static void write_to_uinput_device(struct libevdev_uinput* uinput_dev,
+                                   const struct input_event* events,
+                                   size_t num_events)
+{
+  const size_t size = num_events * sizeof(events[0]);
+  const ssize_t written = write(libevdev_uinput_get_fd(uinput_dev), events, size);
+  if (written < 0) {
+    ERROR("Couldn't write %zu events to uinput: %s", num_events, strerror(errno));
+  }
+  else if ((size_t)written != size) {
+    ERROR("Short write to uinput (%zd of %zu bytes)", written, size);
+  }
+}
+
+static void write_events_to_uinput(struct keyboard* keyboard,
+                                   const struct input_event* events,
+                                   size_t num_events)
+{
+  keyboard->stats.num_events_out += num_events;
+  if (capsule.replay.active) {
+    append_events_to_replay_output(keyboard->index, events, num_events);
+    return;
+  }
+
+  write_to_uinput_device(keyboard->uinput_dev, events, num_events);
+}
+
+static void flush_events_to_uinput(struct keyboard* keyboard)
+{
+  if (keyboard->output.num_events == 0) {
+    return;
+  }
+
+  write_events_to_uinput(keyboard, keyboard->output.events, keyboard->output.num_events);
+  keyboard->output.num_events = 0;
+}
+
+// Keeps keyboards sharing the merged output device from releasing each other's keys. Returns false
+// if the event should be dropped.
+static bool track_merged_output_key(struct keyboard* keyboard, unsigned int code, int value)
+{
+  const bool held = bitset_test(keyboard->output.keys_down, code);
+  uint16_t* num_holders = &capsule.merged_output.num_holders[code];
+  switch (value) {
+  case 0:
+    if (held) {
+      bitset_assign(keyboard->output.keys_down, code, false);
+      --*num_holders;
+    }
+    return *num_holders == 0;
+  case 1:
+    if (!held) {
+      bitset_assign(keyboard->output.keys_down, code, true);
+      ++*num_holders;
+    }
+    return *num_holders == 1;
+  default:
+    return held;  // Repeats
+  }
+}
+
+static void queue_event_to_uinput(struct keyboard* keyboard,
+                                  unsigned int type,
+                                  unsigned int code,
+                                  int value)
+{
+  if (capsule.merged_output.enabled && keyboard->uinput_dev == capsule.merged_output.uinput_dev
+      && type == EV_KEY && !track_merged_output_key(keyboard, code, value)) {
+    return;
+  }
+
+  LOG_EVENT(keyboard, 'W', now_ns(), type, code, value);
+
+  if (keyboard->output.num_events == ARRAY_SIZE(keyboard->output.events)) {
+    flush_events_to_uinput(keyboard);
+  }
+
+  // Time is left zeroed; the kernel stamps events written to uinput
+  keyboard->output.events[keyboard->output.num_events++] =
+      (struct input_event){.type = type, .code = code, .value = value};
+
+  if (type == EV_SYN && code == SYN_REPORT) {
+    flush_events_to_uinput(keyboard);
+  }
+}
+
+// Releases the keys that only this keyboard holds on the merged output device, since it isn't
+// destroyed along with the keyboard
+static void release_merged_output_keys(struct keyboard* keyboard)
+{
+  bool released = false;
+  for (size_t word = 0; word < ARRAY_SIZE(keyboard->output.keys_down); word++) {
+    for (uint64_t keys = keyboard->output.keys_down[word]; keys; keys &= keys - 1) {
+      queue_event_to_uinput(keyboard, EV_KEY, word * 64 + __builtin_ctzll(keys), 0);
+      released = true;
+    }
+  }
+  if (released) {
+    queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+  }
+}
+
+static void write_mouse_events(const struct input_event* events, size_t num_events)
+{
+  if (capsule.replay.active) {
+    append_events_to_replay_output(REPLAY_MOUSE_OUTPUT, events, num_events);
+  }
+  else if (capsule.mouse.uinput_dev) {
+    write_to_uinput_device(capsule.mouse.uinput_dev, events, num_events);
+  }
+}
+
+// Pixels per second, time_ns into the motion
+static double mouse_speed(uint64_t time_ns)
+{
+  if (time_ns >= capsule.mouse.acceleration_ns) {
+    return capsule.mouse.max_speed;
+  }
+
+  const double fraction = (double)time_ns / capsule.mouse.acceleration_ns;
+  double curve = 1.0;
+  for (unsigned int i = 0; i < capsule.mouse.curve_exponent; i++) {
+    curve *= fraction;
+  }
+  return capsule.mouse.start_speed
+         + ((double)capsule.mouse.max_speed - capsule.mouse.start_speed) * curve;
+}
+
+// Sends the motion of the ticks due by now_ns, which is either the current time or the time of an
+// event about to be handled, as for the keyboards' deadlines. Ticks that we were late for are sent
+// together, so the pointer keeps its pace.
+static void move_mouse(uint64_t now_ns)
+{
+  double motion[REL_CNT] = {0};
+  for (; capsule.mouse.next_tick_ns && capsule.mouse.next_tick_ns <= now_ns;
+       capsule.mouse.next_tick_ns += MOUSE_TICK_MS * UINT64_C(1000000)) {
+    const double speed = mouse_speed(capsule.mouse.next_tick_ns - capsule.mouse.start_ns);
+    for (size_t i = 0; i < MOUSE_NUM_MOTIONS; i++) {
+      if (capsule.mouse.num_holds[i] > 0) {
+        const struct mouse_output* output = &mouse_outputs[i];
+        const bool is_wheel = output->rel_code == REL_WHEEL || output->rel_code == REL_HWHEEL;
+        motion[output->rel_code] +=
+            output->direction * (is_wheel ? MOUSE_WHEEL_SPEED : speed) * MOUSE_TICK_MS / 1000.0;
+      }
+    }
+  }
+
+  static const uint16_t rel_codes[] = {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL};
+  struct input_event events[ARRAY_SIZE(rel_codes) + 1];
+  size_t num_events = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(rel_codes); i++) {
+    double* remainder = &capsule.mouse.remainders[rel_codes[i]];
+    *remainder += motion[rel_codes[i]];
+    const int value = (int)*remainder;  // Towards zero
+    if (value != 0) {
+      *remainder -= value;
+      events[num_events++] =
+          (struct input_event){.type = EV_REL, .code = rel_codes[i], .value = value};
+    }
+  }
+  if (num_events > 0) {
+    events[num_events++] = (struct input_event){.type = EV_SYN, .code = SYN_REPORT};
+    write_mouse_events(events, num_events);
+  }
+}
+
+// Periodic, with absolute deadlines, so that the ticks don't drift however late they're handled
+static void arm_mouse_timer(void)
+{
+  if (capsule.mouse.timer_fd < 0) {
+    return;
+  }
+
+  const uint64_t deadline_ns = capsule.mouse.next_tick_ns;
+  const uint64_t interval_ns = deadline_ns ? MOUSE_TICK_MS * UINT64_C(1000000) : 0;
+  const struct itimerspec spec = {
+      .it_value = {.tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000},
+      .it_interval = {.tv_sec = 0, .tv_nsec = interval_ns},
+  };
+  if (timerfd_settime(capsule.mouse.timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+    ERROR("Couldn't arm mouse timer: %s", strerror(errno));
+  }
+}
+
+static bool is_mouse_moving(void)
+{
+  for (size_t i = 0; i < MOUSE_NUM_MOTIONS; i++) {
+    if (capsule.mouse.num_holds[i] > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sends the press, repeat or release of a mouse action, at time_ns
+static void handle_mouse_action(const struct action* action, int value, uint64_t time_ns)
+{
+  if (action->kind == ACTION_KIND_MOUSE_BUTTON) {
+    if (value <= 1) {
+      const struct input_event events[] = {
+          {.type = EV_KEY, .code = action->output.code, .value = value},
+          {.type = EV_SYN, .code = SYN_REPORT},
+      };
+      write_mouse_events(events, ARRAY_SIZE(events));
+    }
+    return;
+  }
+
+  const bool was_moving = is_mouse_moving();
+  uint16_t* num_holds = &capsule.mouse.num_holds[action->output.code];
+  if (value == 1) {
+    ++*num_holds;
+  }
+  else if (value == 0 && *num_holds > 0) {
+    --*num_holds;
+  }
+
+  if (!was_moving && is_mouse_moving()) {
+    capsule.mouse.start_ns = time_ns;
+    capsule.mouse.next_tick_ns = time_ns;  // The first tick is right away
+    move_mouse(time_ns);
+    arm_mouse_timer();
+  }
+  else if (was_moving && !is_mouse_moving()) {
+    capsule.mouse.next_tick_ns = 0;
+    memset(capsule.mouse.remainders, 0, sizeof(capsule.mouse.remainders));
+    arm_mouse_timer();
+  }
+}
+
+// Releases the mouse actions held by a keyboard that's going away, since they're shared by all
+// keyboards rather than destroyed along with it
+static void release_mouse_actions(struct keyboard* keyboard)
+{
+  for (size_t word = 0; word < ARRAY_SIZE(keyboard->state.action_activated); word++) {
+    for (uint64_t keys = keyboard->state.action_activated[word]; keys; keys &= keys - 1) {
+      const unsigned int code = word * 64 + __builtin_ctzll(keys);
+      const struct action* action = &keyboard->state.activated_actions[code];
+      if (is_mouse_action(action)) {
+        handle_mouse_action(action, 0, now_ns());
+      }
+    }
+  }
+  for (size_t i = 0; i < keyboard->state.num_fired_combos; i++) {
+    const struct fired_combo* fired = &keyboard->state.fired_combos[i];
+    if (!fired->released && is_mouse_action(&fired->action)) {
+      handle_mouse_action(&fired->action, 0, now_ns());
+    }
+  }
+}
+
+static void destroy_uinput_device(struct keyboard* keyboard)
+{
+  if (keyboard->uinput_dev != capsule.merged_output.uinput_dev) {
+    libevdev_uinput_destroy(keyboard->uinput_dev);
+  }
+  else {
+    release_merged_output_keys(keyboard);
+  }
+  keyboard->uinput_dev = NULL;
+}
+
+static void close_keyboard(struct keyboard* keyboard)
+{
+  if (!keyboard->in_use) {
+    return;
+  }
+
+  if (keyboard->inode > 0) {
+    DEBUG("ino=%ju", (uintmax_t)keyboard->inode);
+  }
+
+  keyboard_table_remove(&capsule.keyboard_by_inode, keyboard->inode, keyboard);
+  keyboard_table_remove(&capsule.keyboard_by_name, hash_name(keyboard->name), keyboard);
+  if (keyboard->uinput_dev && !keyboard->state.grabbed && !keyboard->state.grab_failed) {
+    capsule.num_pending_grabs--;
+  }
+
+  if (keyboard->dev) {
+    if (keyboard->state.grabbed) {
+      libevdev_grab(keyboard->dev, LIBEVDEV_UNGRAB);
+    }
+    libevdev_free(keyboard->dev);
+  }
+  if (keyboard->uinput_dev) {
+    // Only fully set up keyboards are registered with epoll
+    epoll_ctl(capsule.epoll_fd, EPOLL_CTL_DEL, keyboard->event_fd, NULL);
+    destroy_uinput_device(keyboard);
+    capsule.num_keyboards_removed++;
+  }
+
+  if (keyboard->event_fd >= 0) {
+    close(keyboard->event_fd);
+  }
+  if (keyboard->timer.fd >= 0) {
+    close(keyboard->timer.fd);  // Which also removes it from epoll
+  }
+
+  capsule.closed_keyboards_stats.num_events_in += keyboard->stats.num_events_in;
+  capsule.closed_keyboards_stats.num_events_out += keyboard->stats.num_events_out;
+  capsule.closed_keyboards_stats.num_resyncs += keyboard->stats.num_resyncs;
+
+  release_mouse_actions(keyboard);
+  reset_keyboard(keyboard);
+  capsule.unused_keyboards[capsule.num_unused_keyboards++] = keyboard;
+}
+
+// Lets us know when udev has processed our uinput devices, which is also when display servers learn
+// about them
+static bool watch_udev_data(void)
+{
+  capsule.udev_inotify_fd = inotify_init1(O_NONBLOCK | O_CLOEXEC);
+  if (capsule.udev_inotify_fd == -1) {
+    ERROR("Couldn't open inotify fd: %s", strerror(errno));
+    return false;
+  }
+
+  if (inotify_add_watch(capsule.udev_inotify_fd, UDEV_DATA_PATH, IN_CREATE | IN_MOVED_TO) == -1) {
+    WARNING("Couldn't watch " UDEV_DATA_PATH " (%s); is udev running?", strerror(errno));
+    close(capsule.udev_inotify_fd);
+    capsule.udev_inotify_fd = -1;
+    return true;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &capsule.udev_inotify_fd};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, capsule.udev_inotify_fd, &event) == -1) {
+    ERROR("Couldn't add udev inotify fd to epoll: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+// Editors tend to replace files rather than writing them, so watch the directory
+static bool watch_config_file(void)
+{
+  capsule.config_inotify_fd = inotify_init1(O_NONBLOCK | O_CLOEXEC);
+  if (capsule.config_inotify_fd == -1) {
+    ERROR("Couldn't open inotify fd: %s", strerror(errno));
+    return false;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", capsule.config_path);
+  const char* dir = dirname(path);
+  if (inotify_add_watch(capsule.config_inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    ERROR("Couldn't watch %s: %s", dir, strerror(errno));
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &capsule.config_inotify_fd};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, capsule.config_inotify_fd, &event) == -1) {
+    ERROR("Couldn't add config inotify fd to epoll: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+// Key codes the merged output device supports, which leaves out mouse, joystick and other buttons
+// so that it's only taken for a keyboard
+static bool is_merged_output_key(unsigned int code)
+{
+  if (code >= BTN_DPAD_UP && code <= BTN_DPAD_RIGHT) {
+    return false;
+  }
+  if (code >= BTN_TRIGGER_HAPPY && code <= BTN_TRIGGER_HAPPY40) {
+    return false;
+  }
+  return (code > KEY_RESERVED && code < BTN_MISC) || (code >= KEY_OK && code <= KEY_MAX);
+}
+
+// Keyboards with anything the merged output device doesn't support get a uinput device of their own
+static bool fits_merged_output(const struct libevdev* dev)
+{
+  for (unsigned int type = EV_SYN + 1; type < EV_CNT; type++) {
+    if (type != EV_KEY && type != EV_MSC && type != EV_LED && type != EV_REP
+        && libevdev_has_event_type(dev, type)) {
+      return false;
+    }
+  }
+  for (unsigned int code = 0; code < KEY_CNT; code++) {
+    if (!is_merged_output_key(code) && libevdev_has_event_code(dev, EV_KEY, code)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool create_merged_output_device(void)
+{
+  struct libevdev* dev = libevdev_new();
+  assert(dev);
+  libevdev_set_name(dev, "capsule");
+  libevdev_set_id_bustype(dev, BUS_VIRTUAL);
+  libevdev_enable_event_type(dev, EV_KEY);
+  for (unsigned int code = 0; code < KEY_CNT; code++) {
+    if (is_merged_output_key(code)) {
+      libevdev_enable_event_code(dev, EV_KEY, code, NULL);
+    }
+  }
+  libevdev_enable_event_code(dev, EV_MSC, MSC_SCAN, NULL);
+
+  const int rc = libevdev_uinput_create_from_device(
+      dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &capsule.merged_output.uinput_dev);
+  if (rc < 0) {
+    ERROR("Failed creating merged uinput device: %s", strerror(-rc));
+    libevdev_free(dev);
+    return false;
+  }
+  capsule.merged_output.dev = dev;
+  return true;
+}
+
+// Created once the keymap has mouse actions, and kept until exit
+static bool create_mouse_device(void)
+{
+  struct libevdev* dev = libevdev_new();
+  assert(dev);
+  libevdev_set_name(dev, "capsule mouse");
+  libevdev_set_id_bustype(dev, BUS_VIRTUAL);
+  libevdev_enable_event_type(dev, EV_REL);
+  libevdev_enable_event_code(dev, EV_REL, REL_X, NULL);
+  libevdev_enable_event_code(dev, EV_REL, REL_Y, NULL);
+  libevdev_enable_event_code(dev, EV_REL, REL_WHEEL, NULL);
+  libevdev_enable_event_code(dev, EV_REL, REL_HWHEEL, NULL);
+  libevdev_enable_event_type(dev, EV_KEY);
+  libevdev_enable_event_code(dev, EV_KEY, BTN_LEFT, NULL);
+  libevdev_enable_event_code(dev, EV_KEY, BTN_RIGHT, NULL);
+  libevdev_enable_event_code(dev, EV_KEY, BTN_MIDDLE, NULL);
+
+  const int rc = libevdev_uinput_create_from_device(
+      dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &capsule.mouse.uinput_dev);
+  if (rc < 0) {
+    ERROR("Failed creating mouse uinput device: %s", strerror(-rc));
+    libevdev_free(dev);
+    return false;
+  }
+  capsule.mouse.dev = dev;
+
+  capsule.mouse.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (capsule.mouse.timer_fd == -1) {
+    ERROR("Couldn't create mouse timer: %s", strerror(errno));
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &capsule.mouse.timer_fd};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, capsule.mouse.timer_fd, &event) == -1) {
+    ERROR("Couldn't add mouse timer to epoll: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+// Monitoring is all that's lost without the stats file, so failing to set it up isn't fatal
+static void open_stats_file(void)
+{
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", STATS_FILE_PATH);
+  if (mkdir(dirname(dir), 0755) == -1 && errno != EEXIST) {
+    WARNING("Couldn't create %s: %s", dir, strerror(errno));
+    return;
+  }
+
+  const int fd = open(STATS_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    WARNING("Couldn't open " STATS_FILE_PATH ": %s", strerror(errno));
+    return;
+  }
+  if (ftruncate(fd, sizeof(struct stats_page)) == -1) {
+    WARNING("Couldn't resize " STATS_FILE_PATH ": %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  struct stats_page* page =
+      mmap(NULL, sizeof(struct stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    WARNING("Couldn't map " STATS_FILE_PATH ": %s", strerror(errno));
+    return;
+  }
+
+  memset(page, 0, sizeof(*page));  // Fault the pages in now rather than when publishing
+  memcpy(page->magic, STATS_FILE_MAGIC, sizeof(page->magic));
+  capsule.stats_page = page;
+}
+
+static bool open_control_socket(void)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(capsule.control.path) >= sizeof(addr.sun_path)) {
+    ERROR("Too long control socket path: %s", capsule.control.path);
+    return false;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", capsule.control.path);
+
+  // Left behind if we didn't exit cleanly last time
+  struct stat st;
+  if (lstat(capsule.control.path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(capsule.control.path);
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    ERROR("Couldn't create control socket: %s", strerror(errno));
+    return false;
+  }
+  if (bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    ERROR("Couldn't bind control socket to %s: %s", capsule.control.path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  capsule.control.fd = fd;  // Unlinked at exit from here on
+
+  if (listen(fd, 16) == -1) {
+    ERROR("Couldn't listen on control socket: %s", strerror(errno));
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &capsule.control.fd};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    ERROR("Couldn't add control socket to epoll: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+static bool init_capsule(void)
+{
+  capsule.epoll_fd = -1;
+  capsule.inotify_fd = -1;
+  capsule.inotify_wd = -1;
+  capsule.signal_fd = -1;
+  capsule.config_inotify_fd = -1;
+  capsule.udev_inotify_fd = -1;
+  capsule.control.fd = -1;
+  capsule.mouse.timer_fd = -1;
+
+  capsule.dev_dirp = opendir(INPUT_DEVICE_PATH);
+  if (!capsule.dev_dirp) {
+    ERROR("Couldn't open " INPUT_DEVICE_PATH ": %s", strerror(errno));
+    return false;
+  }
+
+  capsule.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (capsule.epoll_fd == -1) {
+    ERROR("Couldn't create epoll fd: %s", strerror(errno));
+    return false;
+  }
+
+  capsule.inotify_fd = inotify_init1(O_NONBLOCK);
+  if (capsule.inotify_fd == -1) {
+    ERROR("Couldn't open inotify fd: %s", strerror(errno));
+    return false;
+  }
+
+  capsule.inotify_wd =
+      inotify_add_watch(capsule.inotify_fd,
+                        INPUT_DEVICE_PATH,
+                        IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+  if (capsule.inotify_wd == -1) {
+    ERROR("inotify_add_watch failed: %s", strerror(errno));
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &capsule.inotify_fd};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, capsule.inotify_fd, &event) == -1) {
+    ERROR("Couldn't add inotify fd to epoll: %s", strerror(errno));
+    return false;
+  }
+
+  // SIGUSR1 dumps statistics, SIGHUP reloads the config, and SIGINT and SIGTERM make us exit
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    ERROR("Couldn't block signals: %s", strerror(errno));
+    return false;
+  }
+
+  capsule.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (capsule.signal_fd == -1) {
+    ERROR("Couldn't open signal fd: %s", strerror(errno));
+    return false;
+  }
+
+  event = (struct epoll_event){.events = EPOLLIN, .data.ptr = &capsule.signal_fd};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, capsule.signal_fd, &event) == -1) {
+    ERROR("Couldn't add signal fd to epoll: %s", strerror(errno));
+    return false;
+  }
+
+  if (!watch_udev_data()) {
+    return false;
+  }
+
+  if (capsule.merged_output.enabled && !create_merged_output_device()) {
+    return false;
+  }
+
+  if (capsule.control.path && !open_control_socket()) {
+    return false;
+  }
+
+  if (capsule.keymap->uses_mouse && !create_mouse_device()) {
+    return false;
+  }
+
+  open_stats_file();
+
+  return capsule.config_path ? watch_config_file() : true;
+}
+
+static struct keyboard* find_keyboard_by_inode(ino_t inode)
+{
+  return keyboard_table_find(&capsule.keyboard_by_inode, inode, NULL);
+}
+
+static struct keyboard* find_keyboard_by_name(const char* name)
+{
+  return keyboard_table_find(&capsule.keyboard_by_name, hash_name(name), name);
+}
+
+static bool is_keyboard_entry(const char* name)
+{
+  // Hidden entries are temporary links that udev renames into place
+  return name[0] != '.' && strstr(name, "event-kbd");
+}
+
+// Returns a closed keyboard to set up, or NULL if out of memory
+static struct keyboard* alloc_keyboard(void)
+{
+  if (capsule.num_unused_keyboards > 0) {
+    struct keyboard* keyboard = capsule.unused_keyboards[--capsule.num_unused_keyboards];
+    keyboard->in_use = true;
+    return keyboard;
+  }
+
+  if (capsule.num_keyboards == capsule.keyboards_capacity) {
+    const size_t capacity = capsule.keyboards_capacity ? capsule.keyboards_capacity * 2 : 16;
+    struct keyboard** unused_keyboards =
+        realloc(capsule.unused_keyboards, capacity * sizeof(unused_keyboards[0]));
+    if (!unused_keyboards) {
+      return NULL;
+    }
+    capsule.unused_keyboards = unused_keyboards;
+
+    struct keyboard** keyboards = realloc(capsule.keyboards, capacity * sizeof(keyboards[0]));
+    if (!keyboards) {
+      return NULL;
+    }
+    capsule.keyboards = keyboards;
+    capsule.keyboards_capacity = capacity;
+  }
+
+  struct keyboard* keyboard = malloc(sizeof(*keyboard));
+  if (!keyboard) {
+    return NULL;
+  }
+  keyboard->index = capsule.num_keyboards;
+  reset_keyboard(keyboard);
+  keyboard->in_use = true;
+  capsule.keyboards[capsule.num_keyboards++] = keyboard;
+  return keyboard;
+}
+
+static void free_keyboards(void)
+{
+  FOR_EACH_KEYBOARD (keyboard) {
+    close_keyboard(keyboard);
+    free(keyboard);
+  }
+  free(capsule.keyboards);
+  free(capsule.unused_keyboards);
+  free(capsule.keyboard_by_inode.entries);
+  free(capsule.keyboard_by_name.entries);
+}
+
+static uint64_t debounce_threshold_ns(const char* name, const char* device_name)
+{
+  for (size_t i = 0; i < capsule.debounce.num_rules; i++) {
+    const struct debounce_rule* rule = &capsule.debounce.rules[i];
+    if (strcmp(rule->device, name) == 0 || strcmp(rule->device, device_name) == 0) {
+      return rule->threshold_ns;
+    }
+  }
+  return capsule.debounce.default_ns;
+}
+
+static bool setup_keyboard(struct keyboard* keyboard, int dir_fd, const char* name, ino_t inode)
+{
+  DEBUG("%s (ino=%ju)", name, (uintmax_t)inode);
+  keyboard->event_fd = openat(dir_fd, name, O_RDONLY | O_NONBLOCK);
+  if (keyboard->event_fd == -1) {
+    ERROR("Couldn't open %s: %s", name, strerror(errno));
+    goto done;
+  }
+
+  keyboard->dev = libevdev_new();
+  assert(keyboard->dev);  // Weird enough that it's worth getting a crash to know
+
+  if (DEBUG_LOGGING && log_level == LOG_LEVEL_DEBUG) {
+    // TODO: Implement installing of libevdev log callbacks here
+  }
+
+  keyboard->inode = inode;
+  snprintf(keyboard->name, sizeof(keyboard->name), "%s", name);
+
+  int rc = libevdev_set_fd(keyboard->dev, keyboard->event_fd);
+  if (rc < 0) {
+    ERROR("Couldn't set fd for device %s: %s", name, strerror(-rc));
+    goto done;
+  }
+
+  keyboard->debounce.threshold_ns = debounce_threshold_ns(name, libevdev_get_name(keyboard->dev));
+
+  uint64_t* keys_down = keyboard->state.keys_down;
+  if (ioctl(keyboard->event_fd, EVIOCGKEY(sizeof(keyboard->state.keys_down)), keys_down) == -1) {
+    WARNING("Couldn't get key state of %s: %s", name, strerror(errno));
+  }
+
+  // Event timestamps must share clock with clock_gettime() for latency measurements
+  rc = libevdev_set_clock_id(keyboard->dev, CLOCK_MONOTONIC);
+  if (rc < 0) {
+    WARNING("Couldn't set monotonic clock for %s: %s", name, strerror(-rc));
+  }
+
+  if (capsule.merged_output.uinput_dev && fits_merged_output(keyboard->dev)) {
+    keyboard->uinput_dev = capsule.merged_output.uinput_dev;
+  }
+  else {
+    rc = libevdev_uinput_create_from_device(
+        keyboard->dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &keyboard->uinput_dev);
+    if (rc < 0) {
+      ERROR("Failed creating uinput device: %s", strerror(-rc));
+      goto done;
+    }
+  }
+
+  keyboard->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (keyboard->timer.fd == -1) {
+    ERROR("Couldn't create timer for %s: %s", name, strerror(errno));
+    destroy_uinput_device(keyboard);
+    goto done;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &keyboard->timer.fd_kind};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, keyboard->timer.fd, &event) == -1) {
+    ERROR("Couldn't add timer for %s to epoll: %s", name, strerror(errno));
+    destroy_uinput_device(keyboard);
+    goto done;
+  }
+
+  event = (struct epoll_event){.events = EPOLLIN, .data.ptr = &keyboard->evdev_fd_kind};
+  if (epoll_ctl(capsule.epoll_fd, EPOLL_CTL_ADD, keyboard->event_fd, &event) == -1) {
+    ERROR("Couldn't add %s to epoll: %s", name, strerror(errno));
+    destroy_uinput_device(keyboard);
+    goto done;
+  }
+
+  if (!keyboard_table_insert(&capsule.keyboard_by_inode, inode, keyboard)
+      || !keyboard_table_insert(&capsule.keyboard_by_name, hash_name(name), keyboard)) {
+    ERROR("Out of memory for %s", name);
+    epoll_ctl(capsule.epoll_fd, EPOLL_CTL_DEL, keyboard->event_fd, NULL);
+    destroy_uinput_device(keyboard);
+    goto done;
+  }
+
+  keyboard->state.grab_deadline_ns = now_ns() + GRAB_TIMEOUT_MS * UINT64_C(1000000);
+  capsule.num_pending_grabs++;
+  capsule.num_keyboards_added++;
+
+done:
+  if (!keyboard->uinput_dev) {
+    close_keyboard(keyboard);
+  }
+
+  return keyboard->uinput_dev;
+}
+
+static bool scan_keyboards(void)
+{
+  FOR_EACH_KEYBOARD (keyboard) {
+    keyboard->marked_for_deletion = (keyboard->dev != NULL);
+  }
+
+  rewinddir(capsule.dev_dirp);
+
+  struct dirent* dirent;
+  while ((dirent = readdir(capsule.dev_dirp))) {
+    DEBUG("%s", dirent->d_name);
+    if (!is_keyboard_entry(dirent->d_name)) {
+      continue;
+    }
+
+    struct keyboard* keyboard = find_keyboard_by_inode(dirent->d_ino);
+    if (keyboard) {
+      keyboard->marked_for_deletion = false;
+      continue;
+    }
+
+    keyboard = alloc_keyboard();
+    if (!keyboard) {
+      ERROR("Out of memory for keyboard %s", dirent->d_name);
+      continue;
+    }
+
+    if (!setup_keyboard(keyboard, dirfd(capsule.dev_dirp), dirent->d_name, dirent->d_ino)) {
+      ERROR("Couldn't set-up keyboard %s", dirent->d_name);
+    }
+  }
+
+  size_t num_keyboards_setup = 0;
+  FOR_EACH_KEYBOARD (keyboard) {
+    if (keyboard->marked_for_deletion) {
+      close_keyboard(keyboard);
+    }
+    num_keyboards_setup += (keyboard->dev != NULL);
+  }
+
+  return num_keyboards_setup > 0;
+}
+
+static void add_keyboard_entry(const char* name)
+{
+  // Inode of the link itself, as for the d_ino of scan_keyboards()
+  struct stat st;
+  if (fstatat(dirfd(capsule.dev_dirp), name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+    DEBUG("%s already gone: %s", name, strerror(errno));
+    return;
+  }
+
+  struct keyboard* keyboard = find_keyboard_by_name(name);
+  if (keyboard) {
+    if (keyboard->inode == st.st_ino) {
+      return;
+    }
+    close_keyboard(keyboard);  // Replaced by a link to something else
+  }
+
+  keyboard = alloc_keyboard();
+  if (!keyboard) {
+    ERROR("Out of memory for keyboard %s", name);
+    return;
+  }
+
+  if (!setup_keyboard(keyboard, dirfd(capsule.dev_dirp), name, st.st_ino)) {
+    ERROR("Couldn't set-up keyboard %s", name);
+  }
+}
+
+static void remove_keyboard_entry(const char* name)
+{
+  struct keyboard* keyboard = find_keyboard_by_name(name);
+  if (keyboard) {
+    close_keyboard(keyboard);
+  }
+}
+
+static uint64_t event_time_ns(const struct input_event* ev)
+{
+  return (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000;
+}
+
+static void arm_keyboard_timer(struct keyboard* keyboard)
+{
+  const uint64_t deadlines_ns[] = {
+      keyboard->state.tap_hold_deadline_ns,
+      keyboard->state.combo_deadline_ns,
+      keyboard->state.macro_deadline_ns,
+      keyboard->state.repeat_deadline_ns,
+      keyboard->debounce.deadline_ns,
+  };
+  uint64_t deadline_ns = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(deadlines_ns); i++) {
+    if (deadlines_ns[i] && (!deadline_ns || deadlines_ns[i] < deadline_ns)) {
+      deadline_ns = deadlines_ns[i];
+    }
+  }
+  if (deadline_ns == keyboard->timer.armed_ns) {
+    return;
+  }
+  keyboard->timer.armed_ns = deadline_ns;
+
+  if (keyboard->timer.fd >= 0) {
+    const struct itimerspec spec = {
+        .it_value = {.tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000},
+    };
+    if (timerfd_settime(keyboard->timer.fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+      ERROR("Couldn't arm timer for %s: %s", keyboard->name, strerror(errno));
+    }
+  }
+}
+
+// Writes events of the playing macro as they are compiled, except to the merged output device,
+// where keys are tracked like for any other output
+static void write_macro_events(struct keyboard* keyboard,
+                               const struct input_event* events,
+                               size_t num_events)
+{
+  if (capsule.merged_output.enabled && keyboard->uinput_dev == capsule.merged_output.uinput_dev) {
+    for (size_t i = 0; i < num_events; i++) {
+      queue_event_to_uinput(keyboard, events[i].type, events[i].code, events[i].value);
+    }
+    return;
+  }
+  if (num_events == 0) {
+    return;
+  }
+
+  flush_events_to_uinput(keyboard);  // Anything queued goes first
+  if (DEBUG_LOGGING && log_level >= LOG_LEVEL_DEBUG) {
+    const uint64_t time_ns = now_ns();
+    for (size_t i = 0; i < num_events; i++) {
+      log_event(keyboard, 'W', time_ns, events[i].type, events[i].code, events[i].value);
+    }
+  }
+  write_events_to_uinput(keyboard, events, num_events);
+}
+
+// Plays the macro up until its next delay, and leaves the rest for the timer
+static void play_macro(struct keyboard* keyboard)
+{
+  const struct input_event* events = keyboard->state.macro_next;
+  size_t num_events = 0;
+  while (events + num_events < keyboard->state.macro_end
+         && events[num_events].type != MACRO_EVENT_DELAY) {
+    num_events++;
+  }
+  write_macro_events(keyboard, events, num_events);
+
+  const struct input_event* delay = events + num_events;
+  if (delay < keyboard->state.macro_end) {
+    // From the previous deadline rather than now, so that the pace doesn't drift
+    keyboard->state.macro_next = delay + 1;
+    keyboard->state.macro_deadline_ns += (uint64_t)delay->value * 1000000;
+  }
+  else {
+    keyboard->state.macro_next = NULL;
+    keyboard->state.macro_deadline_ns = 0;
+  }
+  arm_keyboard_timer(keyboard);
+}
+
+// Plays the rest of the macro without its delays
+static void finish_macro(struct keyboard* keyboard)
+{
+  while (keyboard->state.macro_next) {
+    play_macro(keyboard);
+  }
+}
+
+static void start_macro(struct keyboard* keyboard, const struct macro* macro)
+{
+  finish_macro(keyboard);  // One at a time
+
+  keyboard->state.macro_next = &capsule.keymap->macro_events[macro->first_event];
+  keyboard->state.macro_end = keyboard->state.macro_next + macro->num_events;
+  keyboard->state.macro_deadline_ns = keyboard->state.time_ns;
+  play_macro(keyboard);
+}
+
+static uint32_t active_layers(const struct keyboard* keyboard)
+{
+  uint32_t layers = UINT32_C(1) << BASE_LAYER | keyboard->state.momentary_layers
+                    | keyboard->state.toggled_layers | keyboard->state.one_shot_layers;
+  if (keyboard->state.caps_lock_pressed) {
+    layers |= UINT32_C(1) << CAPS_LOCK_LAYER;
+  }
+  return layers;
+}
+
+// Searches the active layers for an action for the key, from the top down. Returns NO_ACTION if
+// there's none, and otherwise the action's index, with its layer in *layer.
+static size_t find_action(const struct keyboard* keyboard, unsigned int code, uint8_t* layer)
+{
+  const struct keymap* keymap = capsule.keymap;
+  uint32_t layers = active_layers(keyboard) & keymap->layers_mask;
+  for (; layers; layers &= ~(UINT32_C(1) << *layer)) {
+    *layer = 31 - __builtin_clz(layers);
+    const size_t i = keymap->action_index_by_code[*layer][code];
+    if (i != NO_ACTION) {
+      return i;
+    }
+  }
+  return NO_ACTION;
+}
+
+static void handle_layer_action(struct keyboard* keyboard, const struct action* action, int value)
+{
+  const uint32_t layer_bit = UINT32_C(1) << action->output.layer;
+  switch (action->kind) {
+  case ACTION_KIND_MOMENTARY_LAYER:
+    if (value == 1 && keyboard->state.num_momentary_holds[action->output.layer]++ == 0) {
+      keyboard->state.momentary_layers |= layer_bit;
+    }
+    else if (value == 0 && --keyboard->state.num_momentary_holds[action->output.layer] == 0) {
+      keyboard->state.momentary_layers &= ~layer_bit;
+    }
+    break;
+  case ACTION_KIND_TOGGLE_LAYER:
+    if (value == 1) {
+      keyboard->state.toggled_layers ^= layer_bit;
+    }
+    break;
+  case ACTION_KIND_ONE_SHOT_LAYER:
+    if (value == 1) {
+      keyboard->state.one_shot_layers |= layer_bit;
+    }
+    break;
+  case ACTION_KIND_KEY:
+  case ACTION_KIND_MACRO:
+  case ACTION_KIND_MOUSE_MOTION:
+  case ACTION_KIND_MOUSE_BUTTON:
+    break;
+  }
+}
+
+// Sends the press, repeat or release of an action
+static void apply_action(struct keyboard* keyboard, const struct action* action, int value)
+{
+  if (is_mouse_action(action)) {
+    handle_mouse_action(action, value, keyboard->state.time_ns);
+    return;
+  }
+  if (action->kind == ACTION_KIND_MACRO) {
+    if (value == 1) {
+      start_macro(keyboard, &capsule.keymap->macros[action->output.macro]);
+    }
+    return;
+  }
+  if (action->kind != ACTION_KIND_KEY) {
+    handle_layer_action(keyboard, action, value);
+    return;
+  }
+
+  if (action->output.left_alt && value <= 1) {
+    queue_event_to_uinput(keyboard, EV_KEY, KEY_LEFTALT, value);
+  }
+  if (action->output.right_alt && value <= 1) {
+    queue_event_to_uinput(keyboard, EV_KEY, KEY_RIGHTALT, value);
+  }
+  if (action->output.left_ctrl && value <= 1) {
+    queue_event_to_uinput(keyboard, EV_KEY, KEY_LEFTCTRL, value);
+  }
+  if (action->output.shift && value <= 1) {
+    queue_event_to_uinput(keyboard, EV_KEY, KEY_LEFTSHIFT, value);
+  }
+  queue_event_to_uinput(keyboard, EV_KEY, action->output.code, value);
+}
+
+static void stop_key_repeat(struct keyboard* keyboard)
+{
+  keyboard->state.repeat_code = KEY_RESERVED;
+  keyboard->state.repeat_deadline_ns = 0;
+  arm_keyboard_timer(keyboard);
+}
+
+static void start_key_repeat(struct keyboard* keyboard,
+                             unsigned int code,
+                             const struct key_repeat* repeat)
+{
+  keyboard->state.repeat_code = code;
+  keyboard->state.repeat_layers = active_layers(keyboard);
+  keyboard->state.repeat_start_ns = keyboard->state.time_ns + repeat->delay_ms * UINT64_C(1000000);
+  keyboard->state.num_repeats = 0;
+  keyboard->state.repeat_deadline_ns = keyboard->state.repeat_start_ns;
+  arm_keyboard_timer(keyboard);
+}
+
+// Sends the next repeat of the repeating key, unless the layers have changed since it was pressed
+static void repeat_key(struct keyboard* keyboard)
+{
+  if (active_layers(keyboard) != keyboard->state.repeat_layers) {
+    stop_key_repeat(keyboard);
+    return;
+  }
+
+  const struct action* action = &keyboard->state.activated_actions[keyboard->state.repeat_code];
+  apply_action(keyboard, action, 2);
+  queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+
+  // From the first repeat rather than the previous one, so that rounding doesn't add up
+  keyboard->state.num_repeats++;
+  keyboard->state.repeat_deadline_ns =
+      keyboard->state.repeat_start_ns
+      + keyboard->state.num_repeats * UINT64_C(1000000000) / action->repeat.rate;
+  arm_keyboard_timer(keyboard);
+}
+
+// Remaps, or forwards, a key event other than Caps Lock
+static void handle_key_event(struct keyboard* keyboard, const struct input_event* ev)
+{
+  const struct action* action = NULL;
+  if (ev->code < KEY_CNT && ev->value == 1) {
+    // Only key presses are looked up in the active layers...
+    uint8_t layer;
+    const size_t i = find_action(keyboard, ev->code, &layer);
+    if (i != NO_ACTION) {
+      keyboard->state.activated_actions[ev->code] = capsule.keymap->actions[i];
+      keyboard->state.activated_action_indices[ev->code] = i;
+      action = &keyboard->state.activated_actions[ev->code];
+      keyboard->latency.frame_used_action = true;
+      keyboard->latency.frame_action = i;
+      capsule.action_hits[i]++;
+    }
+    if (!action || !is_layer_action(action)) {
+      keyboard->state.one_shot_layers = 0;
+    }
+  }
+  else if (ev->code < KEY_CNT && bitset_test(keyboard->state.action_activated, ev->code)) {
+    // ... and their repeats and releases go through the action that pressed them
+    action = &keyboard->state.activated_actions[ev->code];
+    const size_t i = keyboard->state.activated_action_indices[ev->code];
+    if (i != NO_ACTION) {
+      keyboard->latency.frame_used_action = true;
+      keyboard->latency.frame_action = i;
+    }
+  }
+
+  if (!action) {
+    queue_event_to_uinput(keyboard, ev->type, ev->code, ev->value);
+    return;
+  }
+
+  const bool repeats = action->kind == ACTION_KIND_KEY && action->repeat.rate > 0;
+  if (repeats && ev->value > 1) {
+    return;  // Repeated by capsule instead
+  }
+  if (ev->value == 0 && ev->code == keyboard->state.repeat_code) {
+    stop_key_repeat(keyboard);
+  }
+  apply_action(keyboard, action, ev->value);
+  if (repeats && ev->value == 1) {
+    start_key_repeat(keyboard, ev->code, &action->repeat);
+  }
+
+  // Something was done, and that's worth book keeping
+  if (ev->value <= 1) {
+    bitset_assign(keyboard->state.action_activated, ev->code, ev->value == 1);
+  }
+}
+
+static void decide_caps_lock_is_modifier(struct keyboard* keyboard)
+{
+  if (!keyboard->state.caps_lock_pressed || keyboard->state.caps_lock_is_modifier) {
+    return;
+  }
+
+  keyboard->state.caps_lock_is_modifier = true;
+  keyboard->state.tap_hold_deadline_ns = 0;
+  arm_keyboard_timer(keyboard);
+
+  if (keyboard->state.has_held_back_press) {
+    keyboard->state.has_held_back_press = false;
+    handle_key_event(keyboard, &keyboard->state.held_back_press);
+    queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+  }
+}
+
+static void handle_caps_lock_event(struct keyboard* keyboard, const struct input_event* ev)
+{
+  if (ev->value > 1) {  // Key repeat
+    decide_caps_lock_is_modifier(keyboard);
+    return;
+  }
+  else if (ev->value == 1) {
+    keyboard->state.caps_lock_pressed = true;
+    keyboard->state.caps_lock_is_modifier = false;
+    if (capsule.tap_hold.tapping_term_ns > 0) {
+      keyboard->state.tap_hold_deadline_ns = event_time_ns(ev) + capsule.tap_hold.tapping_term_ns;
+      arm_keyboard_timer(keyboard);
+    }
+    return;
+  }
+
+  keyboard->state.caps_lock_pressed = false;
+  keyboard->state.tap_hold_deadline_ns = 0;
+  arm_keyboard_timer(keyboard);
+  if (keyboard->state.caps_lock_is_modifier) {
+    return;
+  }
+
+  const unsigned int key = capsule.swap_caps_lock_and_escape ? KEY_ESC : KEY_CAPSLOCK;
+  queue_event_to_uinput(keyboard, EV_KEY, key, 1);
+  queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+  queue_event_to_uinput(keyboard, EV_KEY, key, 0);
+
+  // It was a tap, so a key held back meanwhile was just typed quickly after it
+  if (keyboard->state.has_held_back_press) {
+    keyboard->state.has_held_back_press = false;
+    queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+    handle_key_event(keyboard, &keyboard->state.held_back_press);
+  }
+}
+
+// Returns true if the event was held back, or swallowed, until tap or hold is decided
+static bool hold_back_while_undecided(struct keyboard* keyboard, const struct input_event* ev)
+{
+  if (capsule.tap_hold.policy == TAP_HOLD_POLICY_HOLD_ON_OTHER_KEY_PRESS) {
+    if (ev->value == 1) {
+      decide_caps_lock_is_modifier(keyboard);
+    }
+    return false;
+  }
+
+  if (ev->value == 1) {
+    if (!keyboard->state.has_held_back_press) {
+      keyboard->state.has_held_back_press = true;
+      keyboard->state.held_back_press = *ev;
+      return true;
+    }
+    decide_caps_lock_is_modifier(keyboard);  // A second key; no roll looks like that
+    return false;
+  }
+
+  if (keyboard->state.has_held_back_press && keyboard->state.held_back_press.code == ev->code) {
+    if (ev->value == 0) {
+      decide_caps_lock_is_modifier(keyboard);  // Pressed and released within the hold
+      return false;
+    }
+    return true;  // Repeats of the held back key
+  }
+
+  return false;
+}
+
+// Handles a key event that isn't, or turned out not to be, part of a combo
+static void dispatch_key_event(struct keyboard* keyboard, struct input_event* ev)
+{
+  if (capsule.swap_caps_lock_and_escape && ev->code == KEY_ESC) {
+    ev->code = KEY_CAPSLOCK;
+    queue_event_to_uinput(keyboard, ev->type, ev->code, ev->value);
+    return;
+  }
+
+  if (ev->code == KEY_CAPSLOCK) {
+    handle_caps_lock_event(keyboard, ev);
+    return;
+  }
+
+  if (keyboard->state.caps_lock_pressed && !keyboard->state.caps_lock_is_modifier
+      && hold_back_while_undecided(keyboard, ev)) {
+    return;
+  }
+
+  handle_key_event(keyboard, ev);
+}
+
+static void clear_combo_presses(struct keyboard* keyboard)
+{
+  keyboard->state.num_combo_presses = 0;
+  keyboard->state.combo_press_keys = 0;
+  keyboard->state.combo_deadline_ns = 0;
+  arm_keyboard_timer(keyboard);
+}
+
+// Sends held back presses as the plain key presses they turned out to be
+static void flush_combo_presses(struct keyboard* keyboard)
+{
+  const size_t num_presses = keyboard->state.num_combo_presses;
+  clear_combo_presses(keyboard);
+  for (size_t i = 0; i < num_presses; i++) {
+    dispatch_key_event(keyboard, &keyboard->state.combo_presses[i]);
+    queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+  }
+}
+
+static void fire_combo(struct keyboard* keyboard, const struct combo* combo)
+{
+  if (keyboard->state.num_fired_combos == ARRAY_SIZE(keyboard->state.fired_combos)) {
+    flush_combo_presses(keyboard);
+    return;
+  }
+
+  const size_t i = keyboard->state.num_fired_combos++;
+  keyboard->state.fired_combos[i].action = combo->action;
+  keyboard->state.fired_combos[i].released = false;
+  for (size_t j = 0; j < MAX_COMBO_LENGTH; j++) {
+    keyboard->state.fired_combos[i].codes[j] = j < keyboard->state.num_combo_presses
+                                                   ? keyboard->state.combo_presses[j].code
+                                                   : KEY_RESERVED;
+  }
+  clear_combo_presses(keyboard);
+
+  apply_action(keyboard, &keyboard->state.fired_combos[i].action, 1);
+  queue_event_to_uinput(keyboard, EV_SYN, SYN_REPORT, 0);
+}
+
+// Returns the combo of exactly the held back presses, or NULL. *num_candidates is set to the number
+// of combos they could still be part of, at least up to 2.
+static const struct combo* find_combo(const struct keyboard* keyboard, size_t* num_candidates)
+{
+  const struct keymap* keymap = capsule.keymap;
+  const struct combo* combo = NULL;
+  *num_candidates = 0;
+  for (size_t word = 0; word < ARRAY_SIZE(keyboard->state.combo_candidates); word++) {
+    for (uint64_t bits = keyboard->state.combo_candidates[word]; bits; bits &= bits - 1) {
+      const size_t i = word * 64 + __builtin_ctzll(bits);
+      if (!combo && keymap->combo_keys[i] == keyboard->state.combo_press_keys) {
+        combo = &keymap->combos[i];  // The first one wins, as for actions
+      }
+      if (++*num_candidates > 1 && combo) {
+        return combo;
+      }
+    }
+  }
+  return combo;
+}
+
+static void resolve_combo_presses(struct keyboard* keyboard)
+{
+  size_t num_candidates;
+  const struct combo* combo = find_combo(keyboard, &num_candidates);
+  if (combo) {
+    fire_combo(keyboard, combo);
+  }
+  else {
+    flush_combo_presses(keyboard);
+  }
+}
+
+// Returns true if the event was for a key of a fired combo, which is then taken care of
+static bool handle_fired_combo_key(struct keyboard* keyboard, const struct input_event* ev)
+{
+  for (size_t i = 0; i < keyboard->state.num_fired_combos; i++) {
+    struct fired_combo* fired = &keyboard->state.fired_combos[i];
+    for (size_t j = 0; j < ARRAY_SIZE(fired->codes); j++) {
+      if (fired->codes[j] != ev->code || ev->code == KEY_RESERVED) {
+        continue;
+      }
+
+      if (ev->value == 0) {
+        if (!fired->released) {
+          apply_action(keyboard, &fired->action, 0);
+          fired->released = true;
+        }
+        fired->codes[j] = KEY_RESERVED;
+
+        bool any_held = false;
+        for (size_t k = 0; k < ARRAY_SIZE(fired->codes); k++) {
+          any_held |= fired->codes[k] != KEY_RESERVED;
+        }
+        if (!any_held) {
+          *fired = keyboard->state.fired_combos[--keyboard->state.num_fired_combos];
+        }
+      }
+      else if (ev->value == 2 && !fired->released) {
+        apply_action(keyboard, &fired->action, 2);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Holds back presses of keys that may be part of a combo, until either all the keys of one are
+// pressed, the combo term passes, or something else happens. Returns true if the event was taken
+// care of. Keys not in any combo only cost a lookup.
+static bool handle_combo_key_event(struct keyboard* keyboard, const struct input_event* ev)
+{
+  if (keyboard->state.num_fired_combos > 0 && handle_fired_combo_key(keyboard, ev)) {
+    return true;
+  }
+
+  const struct keymap* keymap = capsule.keymap;
+  const uint8_t key = ev->code < KEY_CNT ? keymap->combo_key_by_code[ev->code] : NO_COMBO_KEY;
+  if (keyboard->state.num_combo_presses > 0) {
+    const uint64_t key_bit = key != NO_COMBO_KEY ? UINT64_C(1) << key : 0;
+    if (ev->value == 2 && (keyboard->state.combo_press_keys & key_bit)) {
+      return true;  // Repeats of a held back key
+    }
+
+    if (ev->value == 1 && key_bit && !(keyboard->state.combo_press_keys & key_bit)
+        && keyboard->state.num_combo_presses < MAX_COMBO_LENGTH) {
+      uint64_t candidates[ARRAY_SIZE(keyboard->state.combo_candidates)];
+      uint64_t any_candidates = 0;
+      for (size_t word = 0; word < ARRAY_SIZE(candidates); word++) {
+        candidates[word] =
+            keyboard->state.combo_candidates[word] & keymap->combos_by_key[key][word];
+        any_candidates |= candidates[word];
+      }
+
+      if (any_candidates) {
+        memcpy(keyboard->state.combo_candidates, candidates, sizeof(candidates));
+        keyboard->state.combo_presses[keyboard->state.num_combo_presses++] = *ev;
+        keyboard->state.combo_press_keys |= key_bit;
+
+        size_t num_candidates;
+        const struct combo* combo = find_combo(keyboard, &num_candidates);
+        if (combo && num_candidates == 1) {
+          fire_combo(keyboard, combo);  // Nothing longer to wait for
+        }
+        return true;
+      }
+    }
+
+    resolve_combo_presses(keyboard);
+    if (keyboard->state.num_fired_combos > 0 && handle_fired_combo_key(keyboard, ev)) {
+      return true;  // Released a key of the combo that just fired
+    }
+  }
+
+  const uint32_t other_layers = keyboard->state.momentary_layers | keyboard->state.toggled_layers
+                                | keyboard->state.one_shot_layers;
+  if (key == NO_COMBO_KEY || ev->value != 1 || keyboard->state.caps_lock_pressed || other_layers) {
+    return false;
+  }
+
+  memcpy(keyboard->state.combo_candidates,
+         keymap->combos_by_key[key],
+         sizeof(keyboard->state.combo_candidates));
+  keyboard->state.combo_presses[0] = *ev;
+  keyboard->state.num_combo_presses = 1;
+  keyboard->state.combo_press_keys = UINT64_C(1) << key;
+  keyboard->state.combo_deadline_ns = event_time_ns(ev) + capsule.combo_term_ns;
+  arm_keyboard_timer(keyboard);
+  return true;
+}
+
+// Fires the keyboard's deadlines up until now_ns, which is either the current time or the time of
+// an event about to be handled; the latter makes the outcome independent of wakeup order
+static void handle_keyboard_deadlines(struct keyboard* keyboard, uint64_t now_ns)
+{
+  keyboard->state.time_ns = now_ns;
+  if (keyboard->state.tap_hold_deadline_ns && now_ns >= keyboard->state.tap_hold_deadline_ns) {
+    decide_caps_lock_is_modifier(keyboard);
+  }
+  if (keyboard->state.combo_deadline_ns && now_ns >= keyboard->state.combo_deadline_ns) {
+    resolve_combo_presses(keyboard);
+  }
+  while (keyboard->state.macro_deadline_ns && now_ns >= keyboard->state.macro_deadline_ns) {
+    play_macro(keyboard);
+  }
+  while (keyboard->state.repeat_deadline_ns && now_ns >= keyboard->state.repeat_deadline_ns) {
+    repeat_key(keyboard);
+  }
+  arm_keyboard_timer(keyboard);
+}
+
+static void handle_input_event(struct keyboard* keyboard, struct input_event* ev)
+{
+  if (keyboard->timer.armed_ns && event_time_ns(ev) >= keyboard->timer.armed_ns) {
+    handle_keyboard_deadlines(keyboard, event_time_ns(ev));
+  }
+  keyboard->state.time_ns = event_time_ns(ev);
+  if (capsule.mouse.next_tick_ns && event_time_ns(ev) >= capsule.mouse.next_tick_ns) {
+    move_mouse(event_time_ns(ev));
+  }
+
+  if (ev->type != EV_KEY) {
+    queue_event_to_uinput(keyboard, ev->type, ev->code, ev->value);
+    return;
+  }
+
+  if (ev->value == 1 && keyboard->state.repeat_code != KEY_RESERVED) {
+    stop_key_repeat(keyboard);  // Only the last key pressed repeats
+  }
+
+  if (!handle_combo_key_event(keyboard, ev)) {
+    dispatch_key_event(keyboard, ev);
+  }
+
+  if (keyboard->state.repeat_code != KEY_RESERVED
+      && active_layers(keyboard) != keyboard->state.repeat_layers) {
+    stop_key_repeat(keyboard);
+  }
+}
+
+static void set_event_time_ns(struct input_event* ev, uint64_t time_ns)
+{
+  ev->input_event_sec = time_ns / 1000000000;
+  ev->input_event_usec = time_ns % 1000000000 / 1000;
+}
+
+// Passes on the last dropped edge of keys whose threshold has passed by now_ns, if it differs from
+// what was passed on before
+static void settle_debounced_keys(struct keyboard* keyboard, uint64_t now_ns)
+{
+  uint64_t deadline_ns = 0;
+  for (size_t word = 0; word < ARRAY_SIZE(keyboard->debounce.unsettled_keys); word++) {
+    for (uint64_t keys = keyboard->debounce.unsettled_keys[word]; keys; keys &= keys - 1) {
+      const unsigned int code = word * 64 + __builtin_ctzll(keys);
+      const uint64_t settle_ns = keyboard->debounce.settle_ns[code];
+      if (settle_ns > now_ns) {
+        deadline_ns = deadline_ns && deadline_ns < settle_ns ? deadline_ns : settle_ns;
+        continue;
+      }
+
+      bitset_assign(keyboard->debounce.unsettled_keys, code, false);
+      const bool down = bitset_test(keyboard->debounce.pending_keys_down, code);
+      if (down == bitset_test(keyboard->debounce.keys_down, code)) {
+        continue;  // Bounced back
+      }
+      bitset_assign(keyboard->debounce.keys_down, code, down);
+      keyboard->debounce.settle_ns[code] = settle_ns + keyboard->debounce.threshold_ns;
+
+      struct input_event ev = {.type = EV_KEY, .code = code, .value = down};
+      set_event_time_ns(&ev, settle_ns);
+      handle_input_event(keyboard, &ev);
+      ev.type = EV_SYN;
+      ev.code = SYN_REPORT;
+      ev.value = 0;
+      handle_input_event(keyboard, &ev);
+    }
+  }
+
+  keyboard->debounce.deadline_ns = deadline_ns;
+  arm_keyboard_timer(keyboard);
+}
+
+// Eager debouncing, so that the first edge isn't delayed. Returns false for chatter.
+static bool debounce_key_event(struct keyboard* keyboard,
+                               const struct input_event* ev,
+                               uint64_t time_ns)
+{
+  if (ev->type != EV_KEY || ev->code >= KEY_CNT) {
+    return true;
+  }
+  if (ev->value > 1) {
+    return bitset_test(keyboard->debounce.keys_down, ev->code);  // Repeats of keys passed on
+  }
+
+  const uint64_t settle_ns = keyboard->debounce.settle_ns[ev->code];
+  if (time_ns < settle_ns) {
+    bitset_assign(keyboard->debounce.unsettled_keys, ev->code, true);
+    bitset_assign(keyboard->debounce.pending_keys_down, ev->code, ev->value);
+    if (!keyboard->debounce.deadline_ns || settle_ns < keyboard->debounce.deadline_ns) {
+      keyboard->debounce.deadline_ns = settle_ns;
+      arm_keyboard_timer(keyboard);
+    }
+    keyboard->stats.num_debounced++;
+    return false;
+  }
+
+  keyboard->debounce.settle_ns[ev->code] = time_ns + keyboard->debounce.threshold_ns;
+  bitset_assign(keyboard->debounce.keys_down, ev->code, ev->value);
+  return true;
+}
+
+static bool debounce_input_event(struct keyboard* keyboard, const struct input_event* ev)
+{
+  const uint64_t time_ns = event_time_ns(ev);
+  if (keyboard->debounce.deadline_ns && time_ns >= keyboard->debounce.deadline_ns) {
+    settle_debounced_keys(keyboard, time_ns);
+  }
+
+  if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+    const bool empty = keyboard->debounce.dropped_in_report && !keyboard->debounce.passed_in_report;
+    keyboard->debounce.dropped_in_report = false;
+    keyboard->debounce.passed_in_report = false;
+    return !empty;
+  }
+  if (!debounce_key_event(keyboard, ev, time_ns)) {
+    keyboard->debounce.dropped_in_report = true;
+    return false;
+  }
+  keyboard->debounce.passed_in_report = true;
+  return true;
+}
+
+// Entry point for events read from keyboards
+static void filter_input_event(struct keyboard* keyboard, struct input_event* ev)
+{
+  if (keyboard->debounce.threshold_ns && !debounce_input_event(keyboard, ev)) {
+    return;
+  }
+  handle_input_event(keyboard, ev);
+}
+
+static void reload_keymap(void)
+{
+  struct keymap* keymap = load_keymap();
+  if (!keymap) {
+    ERROR("Couldn't reload %s; keeping the current mapping", capsule.config_path);
+    return;
+  }
+
+  // Presses held back for combos are matched against the current keymap, so they're let through
+  // first, and macros being played are in it. Held keys don't need any special care, since they
+  // release through their actions.
+  FOR_EACH_KEYBOARD (keyboard) {
+    if (keyboard->state.num_combo_presses > 0 || keyboard->state.macro_next) {
+      flush_combo_presses(keyboard);
+      finish_macro(keyboard);
+      flush_events_to_uinput(keyboard);
+    }
+  }
+  install_keymap(keymap);
+  DEBUG("Reloaded %zu actions", keymap->num_actions);
+
+  if (keymap->uses_mouse && !capsule.mouse.uinput_dev && !capsule.replay.active) {
+    create_mouse_device();
+  }
+}
+
+static bool is_killswitch_active(const struct keyboard* keyboard)
+{
+  return bitset_test(keyboard->state.keys_down, KEY_LEFTCTRL)
+         && bitset_test(keyboard->state.keys_down, KEY_RIGHTCTRL);
+}
+
+// Sets up and tears down keyboards as their entries come and go, falling back to a full rescan if
+// the kernel had to drop events
+static void handle_inotify_events(void)
+{
+  bool rescan = false;
+  for (;;) {
+    // As recommended in man inotify(7):
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const ssize_t len = read(capsule.inotify_fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (len < 0 && errno != EAGAIN) {
+        ERROR("read() gave error %s", strerror(errno));
+      }
+      break;
+    }
+
+    for (char* ptr = buf; ptr < buf + len;) {
+      const struct inotify_event* event = (const struct inotify_event*)ptr;
+      ptr += sizeof(*event) + event->len;
+
+      DEBUG("mask=0x%x name=%s", event->mask, event->len ? event->name : "");
+      if (event->mask & IN_Q_OVERFLOW) {
+        rescan = true;
+      }
+      else if (rescan || event->len == 0 || !is_keyboard_entry(event->name)) {
+        continue;
+      }
+      else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        add_keyboard_entry(event->name);
+      }
+      else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        remove_keyboard_entry(event->name);
+      }
+    }
+  }
+
+  if (rescan) {
+    DEBUG("inotify queue overflowed; rescanning");
+    scan_keyboards();
+  }
+}
+
+static size_t latency_bucket_index(uint64_t ns)
+{
+  if (ns < (1u << LATENCY_SUB_BUCKET_BITS)) {
+    return ns;
+  }
+  const unsigned int msb = 63 - __builtin_clzll(ns);
+  const unsigned int shift = msb - LATENCY_SUB_BUCKET_BITS;
+  const size_t sub_bucket = (ns >> shift) & ((1u << LATENCY_SUB_BUCKET_BITS) - 1);
+  return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+static uint64_t latency_bucket_upper_bound(size_t index)
+{
+  if (index < (1u << LATENCY_SUB_BUCKET_BITS)) {
+    return index;
+  }
+  const unsigned int shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+  const uint64_t sub_bucket = index & ((1u << LATENCY_SUB_BUCKET_BITS) - 1);
+  return ((((1u << LATENCY_SUB_BUCKET_BITS) + sub_bucket + 1) << shift) - 1);
+}
+
+static void record_latency(struct latency_histogram* histogram, uint64_t ns)
+{
+  histogram->num_samples++;
+  histogram->buckets[latency_bucket_index(ns)]++;
+  if (ns > histogram->max_ns) {
+    histogram->max_ns = ns;
+  }
+}
+
+static uint64_t latency_percentile(const struct latency_histogram* histogram, double percentile)
+{
+  const uint64_t rank = (uint64_t)(histogram->num_samples * percentile / 100.0);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(histogram->buckets); i++) {
+    seen += histogram->buckets[i];
+    if (seen > rank) {
+      const uint64_t upper_bound = latency_bucket_upper_bound(i);
+      return upper_bound < histogram->max_ns ? upper_bound : histogram->max_ns;
+    }
+  }
+  return histogram->max_ns;
+}
+
+static void print_latency_histogram(const char* label, const struct latency_histogram* histogram)
+{
+  if (histogram->num_samples == 0) {
+    return;
+  }
+  printf("Latency [%s]: n=%ju p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+         label,
+         (uintmax_t)histogram->num_samples,
+         latency_percentile(histogram, 50.0) / 1000.0,
+         latency_percentile(histogram, 99.0) / 1000.0,
+         latency_percentile(histogram, 99.9) / 1000.0,
+         histogram->max_ns / 1000.0);
+}
+
+static void describe_action_output(const struct action* action, char* output, size_t size)
+{
+  if (action->kind == ACTION_KIND_KEY) {
+    snprintf(output, size, "%s", libevdev_event_code_get_name(EV_KEY, action->output.code));
+  }
+  else if (action->kind == ACTION_KIND_MACRO) {
+    snprintf(output, size, "macro %u", action->output.macro);
+  }
+  else if (is_mouse_action(action)) {
+    for (size_t i = 0; i < ARRAY_SIZE(mouse_outputs); i++) {
+      if (mouse_outputs[i].kind == action->kind && mouse_outputs[i].code == action->output.code) {
+        snprintf(output, size, "%s", mouse_outputs[i].name);
+      }
+    }
+  }
+  else {
+    snprintf(output, size, "layer %u", action->output.layer);
+  }
+}
+
+static void print_statistics(void)
+{
+  FOR_EACH_KEYBOARD (keyboard) {
+    if (keyboard->dev) {
+      char label[256];
+      snprintf(label,
+               sizeof(label),
+               "%s (ino=%ju)",
+               libevdev_get_name(keyboard->dev),
+               (uintmax_t)keyboard->inode);
+      print_latency_histogram(label, &keyboard->latency.histogram);
+      if (keyboard->stats.num_resyncs > 0) {
+        printf("Resyncs [%s]: %ju\n", label, (uintmax_t)keyboard->stats.num_resyncs);
+      }
+      if (keyboard->stats.num_debounced > 0) {
+        printf("Debounced [%s]: %ju\n", label, (uintmax_t)keyboard->stats.num_debounced);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < capsule.keymap->num_actions; i++) {
+    const struct action* action = &capsule.keymap->actions[i];
+    char output[32];
+    describe_action_output(action, output, sizeof(output));
+    char label[96];
+    snprintf(label,
+             sizeof(label),
+             "[layer %u] %s -> %s",
+             action->layer,
+             libevdev_event_code_get_name(EV_KEY, action->code),
+             output);
+    print_latency_histogram(label, &capsule.action_latency[i]);
+  }
+
+  if (capsule.event_log.total_num_dropped > 0) {
+    printf("Events not logged: %ju\n", (uintmax_t)capsule.event_log.total_num_dropped);
+  }
+
+  fflush(stdout);
+}
+
+// Of all keyboards, including closed ones
+static void total_keyboard_stats(uint64_t* num_events_in,
+                                 uint64_t* num_events_out,
+                                 uint64_t* num_resyncs)
+{
+  *num_events_in = capsule.closed_keyboards_stats.num_events_in;
+  *num_events_out = capsule.closed_keyboards_stats.num_events_out;
+  *num_resyncs = capsule.closed_keyboards_stats.num_resyncs;
+  FOR_EACH_KEYBOARD (keyboard) {
+    *num_events_in += keyboard->stats.num_events_in;
+    *num_events_out += keyboard->stats.num_events_out;
+    *num_resyncs += keyboard->stats.num_resyncs;
+  }
+}
+
+static void write_latency_summary(FILE* stream, const struct latency_histogram* histogram)
+{
+  fprintf(stream,
+          " latency_n=%ju latency_p50_us=%.1f latency_p99_us=%.1f latency_max_us=%.1f\n",
+          (uintmax_t)histogram->num_samples,
+          latency_percentile(histogram, 50.0) / 1000.0,
+          latency_percentile(histogram, 99.0) / 1000.0,
+          histogram->max_ns / 1000.0);
+}
+
+// One "name value" pair per line for the totals, followed by a line per keyboard and per action,
+// with "key=value" fields
+static void write_control_snapshot(FILE* stream)
+{
+  uint64_t num_events_in, num_events_out, num_resyncs;
+  total_keyboard_stats(&num_events_in, &num_events_out, &num_resyncs);
+  size_t num_keyboards = 0;
+  FOR_EACH_KEYBOARD (keyboard) {
+    num_keyboards += keyboard->dev != NULL;
+  }
+
+  fprintf(stream, "events_in %ju\n", (uintmax_t)num_events_in);
+  fprintf(stream, "events_out %ju\n", (uintmax_t)num_events_out);
+  fprintf(stream, "resyncs %ju\n", (uintmax_t)num_resyncs);
+  fprintf(stream, "keyboards %zu\n", num_keyboards);
+  fprintf(stream, "keyboards_added %ju\n", (uintmax_t)capsule.num_keyboards_added);
+  fprintf(stream, "keyboards_removed %ju\n", (uintmax_t)capsule.num_keyboards_removed);
+  fprintf(stream, "actions %zu\n", capsule.keymap->num_actions);
+
+  FOR_EACH_KEYBOARD (keyboard) {
+    if (!keyboard->dev) {
+      continue;
+    }
+    const char* grab = keyboard->state.grabbed       ? "grabbed"
+                       : keyboard->state.grab_failed ? "failed"
+                                                     : "pending";
+    fprintf(stream,
+            "keyboard %zu path=%s ino=%ju fd=%d grab=%s events_in=%ju events_out=%ju resyncs=%ju"
+            " debounced=%ju",
+            keyboard->index,
+            keyboard->name,
+            (uintmax_t)keyboard->inode,
+            keyboard->event_fd,
+            grab,
+            (uintmax_t)keyboard->stats.num_events_in,
+            (uintmax_t)keyboard->stats.num_events_out,
+            (uintmax_t)keyboard->stats.num_resyncs,
+            (uintmax_t)keyboard->stats.num_debounced);
+    write_latency_summary(stream, &keyboard->latency.histogram);
+  }
+
+  for (size_t i = 0; i < capsule.keymap->num_actions; i++) {
+    const struct action* action = &capsule.keymap->actions[i];
+    char output[32];
+    describe_action_output(action, output, sizeof(output));
+    for (char* c = output; *c; c++) {
+      *c = *c == ' ' ? '_' : *c;  // Keep fields free of spaces
+    }
+    fprintf(stream,
+            "action %zu layer=%u key=%s output=%s hits=%ju",
+            i,
+            action->layer,
+            libevdev_event_code_get_name(EV_KEY, action->code),
+            output,
+            (uintmax_t)capsule.action_hits[i]);
+    write_latency_summary(stream, &capsule.action_latency[i]);
+  }
+}
+
+// Accepts one client per wakeup, so that keyboards get their turn in between; the listening socket
+// stays readable while more are waiting
+static void handle_control_client(void)
+{
+  const int fd = accept4(capsule.control.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd == -1) {
+    return;  // E.g. the client gave up already
+  }
+
+  char* snapshot;
+  size_t size;
+  FILE* stream = open_memstream(&snapshot, &size);
+  if (!stream) {
+    ERROR("Couldn't open memory stream: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  write_control_snapshot(stream);
+  fclose(stream);
+
+  // Fits in the socket buffer unless there are very many keyboards or actions, and we don't wait
+  // for slow clients in any case; they get the snapshot cut short instead
+  const ssize_t sent = send(fd, snapshot, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0 || (size_t)sent != size) {
+    DEBUG("Sent %zd of %zu bytes to control client", sent, size);
+  }
+  free(snapshot);
+
+  // Anything the client sent is ignored, but left unread it would make the kernel reset the
+  // connection, instead of ending it after the snapshot
+  char discard[256];
+  while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+  }
+  close(fd);
+}
+
+// Makes sequence odd, and orders it before the stores of the update
+static void begin_stats_update(struct stats_page* page)
+{
+  __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_stats_update(struct stats_page* page)
+{
+  __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Copies the counters that changed to the stats file. Called before blocking in epoll_wait(), like
+// drain_event_log(), so it never holds up events; readers don't cost us anything at all.
+static void publish_stats(void)
+{
+  struct stats_page* page = capsule.stats_page;
+  if (!page) {
+    return;
+  }
+
+  bool updating = false;
+  const size_t num_slots = capsule.num_keyboards < STATS_MAX_NUM_KEYBOARDS
+                               ? capsule.num_keyboards
+                               : STATS_MAX_NUM_KEYBOARDS;
+  for (size_t i = 0; i < num_slots; i++) {
+    const struct keyboard* keyboard = capsule.keyboards[i];
+    struct stats_keyboard* slot = &page->keyboards[i];
+    const uint64_t inode = keyboard->dev ? keyboard->inode : 0;
+    if (slot->inode == inode && slot->num_events_in == keyboard->stats.num_events_in
+        && slot->num_events_out == keyboard->stats.num_events_out
+        && slot->num_resyncs == keyboard->stats.num_resyncs
+        && slot->num_debounced == keyboard->stats.num_debounced) {
+      continue;
+    }
+
+    if (!updating) {
+      begin_stats_update(page);
+      updating = true;
+    }
+    slot->inode = inode;
+    slot->num_events_in = keyboard->stats.num_events_in;
+    slot->num_events_out = keyboard->stats.num_events_out;
+    slot->num_resyncs = keyboard->stats.num_resyncs;
+    slot->num_debounced = keyboard->stats.num_debounced;
+    snprintf(slot->name, sizeof(slot->name), "%s", keyboard->name);
+    slot->latency = keyboard->latency.histogram;
+  }
+
+  uint64_t num_events_in, num_events_out, num_resyncs;
+  total_keyboard_stats(&num_events_in, &num_events_out, &num_resyncs);
+  if (!updating && page->num_events_in == num_events_in && page->num_events_out == num_events_out
+      && page->num_resyncs == num_resyncs
+      && page->num_keyboards_added == capsule.num_keyboards_added
+      && page->num_keyboards_removed == capsule.num_keyboards_removed
+      && !capsule.stats_page_outdated) {
+    return;  // Nothing happened
+  }
+  if (!updating) {
+    begin_stats_update(page);
+  }
+
+  page->num_events_in = num_events_in;
+  page->num_events_out = num_events_out;
+  page->num_resyncs = num_resyncs;
+  page->num_keyboards_added = capsule.num_keyboards_added;
+  page->num_keyboards_removed = capsule.num_keyboards_removed;
+  page->num_keyboards = num_slots;
+
+  // Actions are only used by events, which also show in the keyboard counters
+  const size_t num_actions = capsule.keymap->num_actions;
+  page->num_actions = num_actions;
+  memcpy(page->action_hits,
+         capsule.action_hits,
+         (num_actions < STATS_MAX_NUM_ACTIONS ? num_actions : STATS_MAX_NUM_ACTIONS)
+             * sizeof(page->action_hits[0]));
+  capsule.stats_page_outdated = false;
+
+  end_stats_update(page);
+}
+
+static void record_frame_latency(struct keyboard* keyboard, const struct input_event* syn_ev)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  const int64_t latency_ns = ((int64_t)now.tv_sec - syn_ev->input_event_sec) * 1000000000
+                             + now.tv_nsec - (int64_t)syn_ev->input_event_usec * 1000;
+  const uint64_t ns = latency_ns > 0 ? (uint64_t)latency_ns : 0;
+
+  record_latency(&keyboard->latency.histogram, ns);
+  if (keyboard->latency.frame_used_action) {
+    record_latency(&capsule.action_latency[keyboard->latency.frame_action], ns);
+    keyboard->latency.frame_used_action = false;
+  }
+}
+
+static void record_trace_event(const struct keyboard* keyboard, const struct input_event* ev)
+{
+  const struct trace_record record = {
+      .sec = ev->input_event_sec,
+      .usec = ev->input_event_usec,
+      .type = ev->type,
+      .code = ev->code,
+      .value = ev->value,
+      .keyboard = keyboard->index,
+  };
+  // Buffered by stdio, so this normally doesn't cost a syscall
+  if (fwrite(&record, sizeof(record), 1, capsule.trace_file) != 1) {
+    ERROR("Couldn't write to trace file; recording stopped");
+    fclose(capsule.trace_file);
+    capsule.trace_file = NULL;
+  }
+}
+
+// Returns false if the killswitch was activated
+static bool process_keyboard_event(struct keyboard* keyboard, struct input_event* ev)
+{
+  LOG_EVENT(keyboard, 'R', event_time_ns(ev), ev->type, ev->code, ev->value);
+  keyboard->stats.num_events_in++;
+
+  if (ev->type == EV_KEY && ev->code < KEY_CNT) {
+    bitset_assign(keyboard->state.keys_down, ev->code, ev->value != 0);
+  }
+
+  if (is_killswitch_active(keyboard)) {
+    ERROR("KILLSWITCH detected; exiting\n");
+    return false;
+  }
+
+  if (!keyboard->state.grabbed) {
+    return true;  // The display server still gets these directly from the device
+  }
+
+  if (capsule.trace_file) {
+    record_trace_event(keyboard, ev);
+  }
+
+  filter_input_event(keyboard, ev);
+
+  // All events in a frame share kernel timestamp and are flushed to uinput by its SYN_REPORT
+  if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+    record_frame_latency(keyboard, ev);
+  }
+
+  return true;
+}
+
+// Brings the remapper in line with the kernel after SYN_DROPPED. The differences between the key
+// state we've seen and the kernel's are fed through the remapper as a single frame, releases first,
+// so that actions release through what pressed them and nothing is left stuck.
+static void resync_keyboard(struct keyboard* keyboard, const struct input_event* syn_dropped)
+{
+  uint64_t kernel_keys_down[ARRAY_SIZE(keyboard->state.keys_down)];
+  if (ioctl(keyboard->event_fd, EVIOCGKEY(sizeof(kernel_keys_down)), kernel_keys_down) == -1) {
+    ERROR("Couldn't get key state of %s: %s", keyboard->name, strerror(errno));
+    return;
+  }
+
+  keyboard->stats.num_resyncs++;
+  DEBUG("%s dropped events; resyncing", keyboard->name);
+
+  struct input_event ev = {
+      .input_event_sec = syn_dropped->input_event_sec,
+      .input_event_usec = syn_dropped->input_event_usec,
+      .type = EV_KEY,
+  };
+  for (ev.value = 0; ev.value <= 1; ev.value++) {
+    for (size_t word = 0; word < ARRAY_SIZE(kernel_keys_down); word++) {
+      uint64_t changed = kernel_keys_down[word] ^ keyboard->state.keys_down[word];
+      changed &= ev.value ? kernel_keys_down[word] : ~kernel_keys_down[word];
+      for (; changed; changed &= changed - 1) {
+        ev.code = word * 64 + __builtin_ctzll(changed);
+        bitset_assign(keyboard->state.keys_down, ev.code, ev.value);
+        if (!keyboard->state.grabbed) {
+          continue;
+        }
+
+        // A Caps Lock tap that we never saw in time is not worth toggling Caps Lock for. Deciding
+        // it's a modifier also lets through a press held back meanwhile.
+        if (ev.code == KEY_CAPSLOCK && ev.value == 0) {
+          decide_caps_lock_is_modifier(keyboard);
+          keyboard->state.caps_lock_is_modifier = true;  // Even if its press wasn't seen either
+        }
+        if (capsule.trace_file) {
+          record_trace_event(keyboard, &ev);
+        }
+        filter_input_event(keyboard, &ev);
+      }
+    }
+  }
+
+  if (keyboard->state.grabbed) {
+    struct input_event syn = ev;
+    syn.type = EV_SYN;
+    syn.code = SYN_REPORT;
+    syn.value = 0;
+    if (capsule.trace_file) {
+      record_trace_event(keyboard, &syn);
+    }
+    filter_input_event(keyboard, &syn);
+  }
+}
+
+static bool read_keyboard_events_with_libevdev(struct keyboard* keyboard)
+{
+  int rc;
+  do {
+    // Internally, libevdev caches events
+    struct input_event ev;
+    rc = libevdev_next_event(keyboard->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+    if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+      if (!process_keyboard_event(keyboard, &ev)) {
+        return false;
+      }
+    }
+    else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+      // ev is the SYN_DROPPED. Drain libevdev's sync events, which just bring its own state up to
+      // date, and do our own resync instead so that it's the same as for --bulk-read.
+      const struct input_event syn_dropped = ev;
+      while (libevdev_next_event(keyboard->dev, LIBEVDEV_READ_FLAG_SYNC, &ev)
+             == LIBEVDEV_READ_STATUS_SYNC) {
+      }
+      resync_keyboard(keyboard, &syn_dropped);
+      rc = LIBEVDEV_READ_STATUS_SUCCESS;
+    }
+    else if (rc == -ENODEV) {
       DEBUG("No device; it will probably be removed soon");
       break;
     }
-    else if (rc != -EAGAIN) {
-      ERROR("next_event: Got %s", strerror(-rc));
+    else if (rc != -EAGAIN) {
+      ERROR("next_event: Got %s", strerror(-rc));
+    }
+  } while (rc == LIBEVDEV_READ_STATUS_SUCCESS);
+
+  return true;
+}
+
+// Reads many events per syscall, and skips libevdev's per-event copying and state tracking
+static bool read_keyboard_events_in_bulk(struct keyboard* keyboard)
+{
+  for (;;) {
+    struct input_event events[BULK_READ_MAX_NUM_EVENTS];
+    const ssize_t len = read(keyboard->event_fd, events, sizeof(events));
+    if (len < 0) {
+      if (errno == ENODEV) {
+        DEBUG("No device; it will probably be removed soon");
+      }
+      else if (errno != EAGAIN) {
+        ERROR("read() gave error %s", strerror(errno));
+      }
+      return true;
+    }
+
+    const size_t num_events = len / sizeof(events[0]);
+    for (size_t i = 0; i < num_events; i++) {
+      struct input_event* ev = &events[i];
+      if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+        keyboard->state.dropping_events = true;
+        continue;
+      }
+      if (keyboard->state.dropping_events) {
+        // The rest of the frame is incomplete, so skip it and catch up with the kernel instead
+        if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+          keyboard->state.dropping_events = false;
+          resync_keyboard(keyboard, ev);
+        }
+        continue;
+      }
+
+      if (!process_keyboard_event(keyboard, ev)) {
+        return false;
+      }
+    }
+
+    if (num_events < ARRAY_SIZE(events)) {
+      return true;  // Drained
     }
-  } while (rc == LIBEVDEV_READ_STATUS_SUCCESS);
+  }
+}
 
-  return true;
+static bool handle_keyboard_evdev_event(struct keyboard* keyboard)
+{
+  const bool keep_running = capsule.bulk_read ? read_keyboard_events_in_bulk(keyboard)
+                                              : read_keyboard_events_with_libevdev(keyboard);
+
+  // Frames normally end with a SYN_REPORT which flushes; this only catches a truncated frame
+  flush_events_to_uinput(keyboard);
+
+  return keep_running;
+}
+
+static bool is_uinput_device_ready(struct keyboard* keyboard)
+{
+  const char* devnode = libevdev_uinput_get_devnode(keyboard->uinput_dev);
+  struct stat st;
+  if (!devnode || stat(devnode, &st) == -1) {
+    return false;
+  }
+  if (capsule.udev_inotify_fd == -1) {
+    return true;  // Without udev, the node existing is the best we can do
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), UDEV_DATA_PATH "/c%u:%u", major(st.st_rdev), minor(st.st_rdev));
+  return access(path, F_OK) == 0;
+}
+
+static bool is_any_key_down(const struct keyboard* keyboard)
+{
+  for (size_t i = 0; i < ARRAY_SIZE(keyboard->state.keys_down); i++) {
+    if (keyboard->state.keys_down[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void grab_ready_keyboards(void)
+{
+  // Grab devices to remove duplicate events (i.e., 1 from real device + 1 from virtual device).
+  // Don't do it before X11/Wayland has found our uinput device, or while keys are held down since
+  // their releases would never reach anyone.
+  if (capsule.num_pending_grabs == 0) {
+    return;
+  }
+
+  const uint64_t now = now_ns();
+  FOR_EACH_KEYBOARD (keyboard) {
+    if (!keyboard->dev || keyboard->state.grabbed || keyboard->state.grab_failed) {
+      continue;
+    }
+    if (now < keyboard->state.grab_deadline_ns && !is_uinput_device_ready(keyboard)) {
+      continue;
+    }
+    if (is_any_key_down(keyboard)) {
+      continue;  // Retried on the next event from the keyboard
+    }
+
+    keyboard->state.grabbed = libevdev_grab(keyboard->dev, LIBEVDEV_GRAB) == 0;
+    keyboard->state.grab_failed = !keyboard->state.grabbed;
+    capsule.num_pending_grabs--;
+    if (keyboard->state.grab_failed) {
+      ERROR("Couldn't grab %s; leaving it alone", keyboard->name);
+    }
+    DEBUG("%s grabbed after %.1f ms",
+          keyboard->name,
+          (now + GRAB_TIMEOUT_MS * 1000000.0 - keyboard->state.grab_deadline_ns) / 1e6);
+  }
 }
 
-static void grab_all_keyboards(void)
+// Time until the earliest grab deadline, or -1 if none is pending
+static int grab_timeout_ms(void)
 {
-  // Grab devices to remove duplicate events (i.e., 1 from real device + 1 from virtual device)
+  if (capsule.num_pending_grabs == 0) {
+    return -1;
+  }
+
+  const uint64_t now = now_ns();
+  int timeout_ms = -1;
   FOR_EACH_KEYBOARD (keyboard) {
-    if (keyboard->dev && !keyboard->state.grabbed) {
-      keyboard->state.grabbed = libevdev_grab(keyboard->dev, LIBEVDEV_GRAB) == 0;
+    if (keyboard->dev && !keyboard->state.grabbed && !keyboard->state.grab_failed
+        && keyboard->state.grab_deadline_ns > now) {
+      const int ms = (keyboard->state.grab_deadline_ns - now + 999999) / 1000000;
+      timeout_ms = (timeout_ms == -1 || ms < timeout_ms) ? ms : timeout_ms;
+    }
+  }
+  return timeout_ms;
+}
+
+static void drain_udev_inotify_events(void)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (read(capsule.udev_inotify_fd, buf, sizeof(buf)) > 0) {
+    // Any new device could be ours; grab_ready_keyboards() checks them all
+  }
+}
+
+static void handle_keyboard_timer(struct keyboard* keyboard)
+{
+  uint64_t expirations;
+  if (read(keyboard->timer.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;  // Spurious, e.g. re-armed since it fired
+  }
+
+  keyboard->timer.armed_ns = 0;
+  const uint64_t time_ns = now_ns();
+  if (keyboard->debounce.deadline_ns && time_ns >= keyboard->debounce.deadline_ns) {
+    settle_debounced_keys(keyboard, time_ns);
+  }
+  handle_keyboard_deadlines(keyboard, time_ns);
+  flush_events_to_uinput(keyboard);
+}
+
+static void handle_mouse_timer(void)
+{
+  uint64_t expirations;
+  if (read(capsule.mouse.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;  // Spurious, e.g. disarmed since it fired
+  }
+  move_mouse(now_ns());
+}
+
+// Returns true if a signal asked us to exit
+static bool handle_signals(void)
+{
+  struct signalfd_siginfo info;
+  while (read(capsule.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGUSR1) {
+      print_statistics();
+    }
+    else if (info.ssi_signo == SIGHUP) {
+      reload_keymap();
+    }
+    else {
+      DEBUG("Got signal %u; exiting", info.ssi_signo);
+      return true;
     }
   }
+  return false;
 }
 
-static void run_event_loop(void)
+static void handle_config_inotify_events(void)
 {
-  // Unfortunate, but give X11/Wayland "some time" to find our newly created uinput devices
-  usleep(500 * 1000);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", capsule.config_path);
+  const char* config_name = basename(path);
+
+  bool config_changed = false;
+  for (;;) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const ssize_t len = read(capsule.config_inotify_fd, buf, sizeof(buf));
+    if (len <= 0) {
+      break;
+    }
+
+    for (char* ptr = buf; ptr < buf + len;) {
+      const struct inotify_event* event = (const struct inotify_event*)ptr;
+      config_changed |= event->len > 0 && strcmp(event->name, config_name) == 0;
+      ptr += sizeof(*event) + event->len;
+    }
+  }
+
+  if (config_changed) {
+    reload_keymap();
+  }
+}
 
-  grab_all_keyboards();
+// Returns true if the loop exited due to SIGINT/SIGTERM
+static bool run_event_loop(void)
+{
+  grab_ready_keyboards();
 
-  struct pollfd pollfd_array[POLLFDS_MAX_NUM_FDS];
-  size_t num_fds = construct_pollfd_array(pollfd_array, ARRAY_SIZE(pollfd_array));
+  for (;;) {
+    drain_event_log();
+    publish_stats();
 
-  int events_to_handle = -1;  // -1 = any number, >= 0 = as many before exiting
-  while (poll(pollfd_array, num_fds, -1) > 0) {
-    if (pollfd_array[0].revents & POLLIN) {
-      drain_inotify_events();
-      scan_keyboards();
-      grab_all_keyboards();
-      num_fds = construct_pollfd_array(pollfd_array, ARRAY_SIZE(pollfd_array));
+    struct epoll_event events[EPOLL_MAX_NUM_EVENTS];
+    const int num_events =
+        epoll_wait(capsule.epoll_fd, events, ARRAY_SIZE(events), grab_timeout_ms());
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERROR("epoll_wait failed: %s", strerror(errno));
+      return false;
+    }
+    if (num_events == 0) {
+      grab_ready_keyboards();  // Some grab deadline passed
       continue;
     }
 
-    struct pollfd* keyboard_pollfd = &pollfd_array[1];
-    do {
-      struct keyboard* keyboard = get_keyboard_from_pollfd(pollfd_array, keyboard_pollfd);
-      if (keyboard_pollfd->revents & POLLERR) {
-        close_keyboard(keyboard);
-        num_fds = construct_pollfd_array(pollfd_array, ARRAY_SIZE(pollfd_array));
-        break;
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == &capsule.signal_fd) {
+        if (handle_signals()) {
+          return true;
+        }
+        continue;
+      }
+      if (events[i].data.ptr == &capsule.config_inotify_fd) {
+        handle_config_inotify_events();
+        continue;
+      }
+      if (events[i].data.ptr == &capsule.inotify_fd) {
+        handle_inotify_events();
+        grab_ready_keyboards();
+        continue;
+      }
+      if (events[i].data.ptr == &capsule.udev_inotify_fd) {
+        drain_udev_inotify_events();
+        grab_ready_keyboards();
+        continue;
+      }
+      if (events[i].data.ptr == &capsule.control.fd) {
+        handle_control_client();
+        continue;
+      }
+      if (events[i].data.ptr == &capsule.mouse.timer_fd) {
+        handle_mouse_timer();
+        continue;
+      }
+
+      const enum keyboard_fd_kind* fd_kind = events[i].data.ptr;
+      struct keyboard* keyboard = *fd_kind == KEYBOARD_FD_TIMER
+                                      ? CONTAINER_OF(fd_kind, struct keyboard, timer.fd_kind)
+                                      : CONTAINER_OF(fd_kind, struct keyboard, evdev_fd_kind);
+      if (!keyboard->dev) {
+        continue;  // Closed by a rescan earlier in this batch
       }
-      if (!(keyboard_pollfd->revents & POLLIN)) {
+      if (*fd_kind == KEYBOARD_FD_TIMER) {
+        handle_keyboard_timer(keyboard);
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close_keyboard(keyboard);
         continue;
       }
 
       if (!handle_keyboard_evdev_event(keyboard)) {
-        goto done;
+        return false;
+      }
+      if (!keyboard->state.grabbed) {
+        grab_ready_keyboards();  // Maybe the keys that held off grabbing were released
+      }
+    }
+  }
+}
+
+static void prefault_stack(void)
+{
+  volatile char stack[PREFAULT_STACK_SIZE];
+  const long page_size = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < sizeof(stack); i += page_size) {
+    stack[i] = 0;
+  }
+}
+
+// Best effort; what we actually got is reported, since it depends on privileges and cgroup limits
+static void enter_realtime_mode(void)
+{
+  if (capsule.realtime.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(capsule.realtime.cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+      WARNING("Couldn't pin to CPU %d: %s", capsule.realtime.cpu, strerror(errno));
+    }
+  }
+
+  const struct sched_param param = {.sched_priority = capsule.realtime.priority};
+  if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == -1) {
+    WARNING("Couldn't set SCHED_FIFO priority %d: %s", param.sched_priority, strerror(errno));
+  }
+
+  // Everything is set up by now, so lock it all in memory; later allocations are locked too
+  prefault_stack();
+  const bool locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+  if (!locked) {
+    WARNING("Couldn't lock memory: %s", strerror(errno));
+  }
+
+  struct sched_param effective_param;
+  const int policy = sched_getscheduler(0) & ~SCHED_RESET_ON_FORK;
+  sched_getparam(0, &effective_param);
+  cpu_set_t cpus;
+  sched_getaffinity(0, sizeof(cpus), &cpus);
+  printf("Scheduling: %s priority %d, %d CPU(s), memory %slocked\n",
+         policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER",
+         effective_param.sched_priority,
+         CPU_COUNT(&cpus),
+         locked ? "" : "not ");
+  fflush(stdout);
+}
+
+static bool open_trace_file_for_recording(const char* path)
+{
+  capsule.trace_file = fopen(path, "wb");
+  if (!capsule.trace_file) {
+    ERROR("Couldn't open %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  setvbuf(capsule.trace_file, NULL, _IOFBF, 64 * 1024);
+  if (fwrite(TRACE_FILE_MAGIC, strlen(TRACE_FILE_MAGIC), 1, capsule.trace_file) != 1) {
+    ERROR("Couldn't write to %s", path);
+    return false;
+  }
+  return true;
+}
+
+static struct trace_record* load_trace_file(const char* path, size_t* num_records)
+{
+  struct trace_record* records = NULL;
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    ERROR("Couldn't open %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  char magic[sizeof(TRACE_FILE_MAGIC) - 1];
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_FILE_MAGIC, sizeof(magic))) {
+    ERROR("%s is not a capsule trace", path);
+    goto done;
+  }
+
+  size_t capacity = 4096;
+  *num_records = 0;
+  records = malloc(capacity * sizeof(*records));
+  assert(records);
+  while (fread(&records[*num_records], sizeof(*records), 1, file) == 1) {
+    if (++*num_records == capacity) {
+      capacity *= 2;
+      records = realloc(records, capacity * sizeof(*records));
+      assert(records);
+    }
+  }
+
+done:
+  fclose(file);
+  return records;
+}
+
+// Feeds a recorded trace through handle_input_event() without any devices, and prints the
+// resulting output stream to stdout and the throughput to stderr
+static bool replay_trace(const char* path, unsigned int iterations)
+{
+  size_t num_records;
+  struct trace_record* records = load_trace_file(path, &num_records);
+  if (!records) {
+    return false;
+  }
+
+  for (size_t i = 0; i < num_records; i++) {
+    while (capsule.num_keyboards <= records[i].keyboard) {
+      if (!alloc_keyboard()) {
+        ERROR("Out of memory for keyboard %u", records[i].keyboard);
+        free(records);
+        return false;
+      }
+    }
+  }
+
+  capsule.replay.active = true;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned int iteration = 0; iteration < iterations; iteration++) {
+    FOR_EACH_KEYBOARD (keyboard) {
+      reset_keyboard(keyboard);
+      keyboard->debounce.threshold_ns = capsule.debounce.default_ns;
+    }
+    memset(capsule.merged_output.num_holders, 0, sizeof(capsule.merged_output.num_holders));
+    memset(capsule.mouse.num_holds, 0, sizeof(capsule.mouse.num_holds));
+    memset(capsule.mouse.remainders, 0, sizeof(capsule.mouse.remainders));
+    capsule.mouse.next_tick_ns = 0;
+    capsule.replay.num_output = 0;
+
+    for (size_t i = 0; i < num_records; i++) {
+      struct input_event ev = {
+          .input_event_sec = records[i].sec,
+          .input_event_usec = records[i].usec,
+          .type = records[i].type,
+          .code = records[i].code,
+          .value = records[i].value,
+      };
+      struct keyboard* keyboard = capsule.keyboards[records[i].keyboard];
+      filter_input_event(keyboard, &ev);
+      if (DEBUG_LOGGING && log_level >= LOG_LEVEL_DEBUG) {
+        drain_event_log();
       }
-    } while (++keyboard_pollfd != &pollfd_array[ARRAY_SIZE(pollfd_array)]);
+    }
+    FOR_EACH_KEYBOARD (keyboard) {
+      flush_events_to_uinput(keyboard);
+    }
+    drain_event_log();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (size_t i = 0; i < capsule.replay.num_output; i++) {
+    const struct trace_record* record = &capsule.replay.output[i];
+    printf("%u %s %s %d\n",
+           record->keyboard,
+           libevdev_event_type_get_name(record->type),
+           libevdev_event_code_get_name(record->type, record->code),
+           record->value);
+  }
+
+  const double elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  const double num_events = (double)num_records * iterations;
+  fprintf(stderr,
+          "Replayed %zu events x %u: %.0f events/s, %.1f ns/event, %zu events out\n",
+          num_records,
+          iterations,
+          num_events > 0 ? num_events / (elapsed_ns / 1e9) : 0.0,
+          num_events > 0 ? elapsed_ns / num_events : 0.0,
+          capsule.replay.num_output);
 
-    if (events_to_handle >= 0 && --events_to_handle == -1)
+  free(records);
+  free(capsule.replay.output);
+  free_keyboards();
+  return true;
+}
+
+// Parses the decimal number of a switch, which must be at most max
+static bool parse_switch_number(const char* arg, unsigned long max, unsigned long* value)
+{
+  char* end;
+  errno = 0;
+  *value = strtoul(arg, &end, 10);
+  return isdigit((unsigned char)arg[0]) && *end == '\0' && errno == 0 && *value <= max;
+}
+
+// Parses "[DEVICE=]MS" of --debounce
+static bool add_debounce_rule(char* arg)
+{
+  char* threshold = strrchr(arg, '=');
+  unsigned long threshold_ms;
+  if (!parse_switch_number(threshold ? threshold + 1 : arg, MAX_DEBOUNCE_MS, &threshold_ms)
+      || threshold == arg) {
+    ERROR("Expected --debounce [DEVICE=]MS, with MS at most %d", MAX_DEBOUNCE_MS);
+    return false;
+  }
+
+  if (!threshold) {
+    capsule.debounce.default_ns = threshold_ms * UINT64_C(1000000);
+    return true;
+  }
+  if (capsule.debounce.num_rules == ARRAY_SIZE(capsule.debounce.rules)) {
+    ERROR("At most %d devices can have their own debounce threshold", MAX_NUM_DEBOUNCE_RULES);
+    return false;
+  }
+  *threshold = '\0';
+  capsule.debounce.rules[capsule.debounce.num_rules++] = (struct debounce_rule){
+      .device = arg,
+      .threshold_ns = threshold_ms * UINT64_C(1000000),
+  };
+  return true;
+}
+
+// Parses "START_SPEED,MAX_SPEED,MS,EXPONENT" of --mouse-curve
+static bool parse_mouse_curve(char* arg)
+{
+  const unsigned long maxima[] = {
+      MAX_MOUSE_SPEED,
+      MAX_MOUSE_SPEED,
+      MAX_MOUSE_ACCELERATION_MS,
+      MAX_MOUSE_CURVE_EXPONENT,
+  };
+  unsigned long fields[ARRAY_SIZE(maxima)];
+  bool parsed = true;
+  char* field = arg;
+  for (size_t i = 0; i < ARRAY_SIZE(fields) && parsed; i++) {
+    char* comma = strchr(field, ',');
+    if ((comma != NULL) != (i + 1 < ARRAY_SIZE(fields))) {
+      parsed = false;
       break;
+    }
+    if (comma) {
+      *comma = '\0';
+    }
+    parsed = parse_switch_number(field, maxima[i], &fields[i]) && fields[i] > 0;
+    field = comma + 1;
+  }
+  if (!parsed || fields[1] < fields[0]) {
+    ERROR("Expected --mouse-curve START_SPEED,MAX_SPEED,MS,EXPONENT, with speeds from 1 to %d and "
+          "START_SPEED at most MAX_SPEED, MS from 1 to %d, and EXPONENT from 1 to %d",
+          MAX_MOUSE_SPEED,
+          MAX_MOUSE_ACCELERATION_MS,
+          MAX_MOUSE_CURVE_EXPONENT);
+    return false;
   }
 
-done:;
+  capsule.mouse.start_speed = fields[0];
+  capsule.mouse.max_speed = fields[1];
+  capsule.mouse.acceleration_ns = fields[2] * UINT64_C(1000000);
+  capsule.mouse.curve_exponent = fields[3];
+  return true;
 }
 
 static void print_usage(void)
@@ -488,21 +4081,40 @@ static void print_usage(void)
           "Usage: %s"
           " [--swap-caps-lock-and-escape]"
           " [--debug]"
+          " [--config CONFIG_FILE]"
+          " [--tapping-term MS]"
+          " [--permissive-hold]"
+          " [--combo-term MS]"
+          " [--mouse-curve START_SPEED,MAX_SPEED,MS,EXPONENT]"
+          " [--key-repeat DELAY_MS,RATE]"
+          " [--debounce [DEVICE=]MS]..."
+          " [--merged-output]"
+          " [--bulk-read]"
+          " [--realtime [--realtime-priority N] [--cpu N]]"
+          " [--control-socket PATH]"
+          " [--record TRACE_FILE]"
+          " [--replay TRACE_FILE [--replay-iterations N]]"
           "\n",
           program_invocation_name);
 }
 
 int main(int argc, char* argv[])
 {
-  if (geteuid() != 0) {
-    ERROR("Program must run as root to be able to access inputs");
-    print_usage();
-    return -1;
-  }
+  int exit_code = -1;
+  const char* config_path = NULL;
+  const char* record_path = NULL;
+  const char* replay_path = NULL;
+  unsigned int replay_iterations = 1;
+  bool realtime_tuned = false;  // By --realtime-priority or --cpu
 
-  if (!init_capsule()) {
-    goto done;
-  }
+  capsule.combo_term_ns = DEFAULT_COMBO_TERM_MS * UINT64_C(1000000);
+  capsule.mouse.timer_fd = -1;
+  capsule.mouse.start_speed = DEFAULT_MOUSE_START_SPEED;
+  capsule.mouse.max_speed = DEFAULT_MOUSE_MAX_SPEED;
+  capsule.mouse.acceleration_ns = DEFAULT_MOUSE_ACCELERATION_MS * UINT64_C(1000000);
+  capsule.mouse.curve_exponent = DEFAULT_MOUSE_CURVE_EXPONENT;
+  capsule.realtime.priority = DEFAULT_REALTIME_PRIORITY;
+  capsule.realtime.cpu = -1;
 
   while (argc > 1) {
     if (strcmp("-h", argv[1]) == 0 || strcmp("-help", argv[1]) == 0
@@ -512,11 +4124,122 @@ int main(int argc, char* argv[])
     }
 
     if (strcmp("--debug", argv[1]) == 0) {
+      if (!DEBUG_LOGGING) {
+        WARNING("Built without debug logging; --debug has no effect");
+      }
       log_level = LOG_LEVEL_DEBUG;
     }
     else if (strcmp("--swap-caps-lock-and-escape", argv[1]) == 0) {
       capsule.swap_caps_lock_and_escape = true;
     }
+    else if (strcmp("--merged-output", argv[1]) == 0) {
+      capsule.merged_output.enabled = true;
+    }
+    else if (strcmp("--bulk-read", argv[1]) == 0) {
+      capsule.bulk_read = true;
+    }
+    else if (strcmp("--tapping-term", argv[1]) == 0 && argc > 2) {
+      unsigned long tapping_term_ms;
+      if (!parse_switch_number(argv[2], UINT32_MAX, &tapping_term_ms)) {
+        ERROR("Expected --tapping-term MS");
+        return -1;
+      }
+      capsule.tap_hold.tapping_term_ns = tapping_term_ms * UINT64_C(1000000);
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--combo-term", argv[1]) == 0 && argc > 2) {
+      unsigned long combo_term_ms;
+      if (!parse_switch_number(argv[2], UINT32_MAX, &combo_term_ms)) {
+        ERROR("Expected --combo-term MS");
+        return -1;
+      }
+      capsule.combo_term_ns = combo_term_ms * UINT64_C(1000000);
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--mouse-curve", argv[1]) == 0 && argc > 2) {
+      if (!parse_mouse_curve(argv[2])) {
+        return -1;
+      }
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--key-repeat", argv[1]) == 0 && argc > 2) {
+      if (!parse_key_repeat(argv[2], &capsule.key_repeat)) {
+        return -1;
+      }
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--debounce", argv[1]) == 0 && argc > 2) {
+      if (!add_debounce_rule(argv[2])) {
+        return -1;
+      }
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--permissive-hold", argv[1]) == 0) {
+      capsule.tap_hold.policy = TAP_HOLD_POLICY_PERMISSIVE_HOLD;
+    }
+    else if (strcmp("--realtime", argv[1]) == 0) {
+      capsule.realtime.enabled = true;
+    }
+    else if (strcmp("--realtime-priority", argv[1]) == 0 && argc > 2) {
+      const int min_priority = sched_get_priority_min(SCHED_FIFO);
+      const int max_priority = sched_get_priority_max(SCHED_FIFO);
+      unsigned long priority;
+      if (!parse_switch_number(argv[2], max_priority, &priority)
+          || priority < (unsigned long)min_priority) {
+        ERROR("Expected --realtime-priority N, with N from %d to %d", min_priority, max_priority);
+        return -1;
+      }
+      capsule.realtime.priority = priority;
+      realtime_tuned = true;
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--cpu", argv[1]) == 0 && argc > 2) {
+      unsigned long cpu;
+      if (!parse_switch_number(argv[2], CPU_SETSIZE - 1, &cpu)) {
+        ERROR("Expected --cpu N, with N from 0 to %d", CPU_SETSIZE - 1);
+        return -1;
+      }
+      capsule.realtime.cpu = cpu;
+      realtime_tuned = true;
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--config", argv[1]) == 0 && argc > 2) {
+      config_path = argv[2];
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--control-socket", argv[1]) == 0 && argc > 2) {
+      capsule.control.path = argv[2];
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--record", argv[1]) == 0 && argc > 2) {
+      record_path = argv[2];
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--replay", argv[1]) == 0 && argc > 2) {
+      replay_path = argv[2];
+      argc--;
+      argv++;
+    }
+    else if (strcmp("--replay-iterations", argv[1]) == 0 && argc > 2) {
+      unsigned long iterations;
+      if (!parse_switch_number(argv[2], UINT_MAX, &iterations) || iterations == 0) {
+        ERROR("Expected --replay-iterations N, with N at least 1");
+        return -1;
+      }
+      replay_iterations = iterations;
+      argc--;
+      argv++;
+    }
     else {
       ERROR("Unrecognized switch: %s", argv[1]);
       print_usage();
@@ -527,21 +4250,104 @@ int main(int argc, char* argv[])
     argv++;
   }
 
+  if (realtime_tuned && !capsule.realtime.enabled) {
+    ERROR("--realtime-priority and --cpu only apply with --realtime");
+    return -1;
+  }
+
+  if (!config_path && access(DEFAULT_CONFIG_PATH, F_OK) == 0) {
+    config_path = DEFAULT_CONFIG_PATH;
+  }
+  capsule.config_path = config_path;
+
+  struct keymap* keymap = load_keymap();
+  if (!keymap) {
+    return -1;
+  }
+  install_keymap(keymap);
+
+  if (replay_path) {
+    return replay_trace(replay_path, replay_iterations) ? 0 : -1;
+  }
+
+  if (geteuid() != 0) {
+    ERROR("Program must run as root to be able to access inputs");
+    print_usage();
+    return -1;
+  }
+
+  if (!init_capsule()) {
+    goto done;
+  }
+
+  if (record_path && !open_trace_file_for_recording(record_path)) {
+    goto done;
+  }
+
   if (!scan_keyboards()) {
     WARNING("Found no keyboards connected; this is probably a bug");
     goto done;
   }
 
-  run_event_loop();
+  if (capsule.realtime.enabled) {
+    enter_realtime_mode();
+  }
+
+  if (run_event_loop()) {
+    exit_code = 0;
+  }
+
+  drain_event_log();
+  print_statistics();
 
 done:
-  FOR_EACH_KEYBOARD (keyboard) {
-    close_keyboard(keyboard);
+  free_keyboards();
+
+  if (capsule.merged_output.uinput_dev) {
+    libevdev_uinput_destroy(capsule.merged_output.uinput_dev);
+    libevdev_free(capsule.merged_output.dev);
   }
 
+  if (capsule.trace_file) {
+    fclose(capsule.trace_file);
+  }
   if (capsule.dev_dirp) {
     closedir(capsule.dev_dirp);
   }
+  if (capsule.inotify_fd >= 0) {
+    close(capsule.inotify_fd);
+  }
+  if (capsule.signal_fd >= 0) {
+    close(capsule.signal_fd);
+  }
+  if (capsule.config_inotify_fd >= 0) {
+    close(capsule.config_inotify_fd);
+  }
+  if (capsule.udev_inotify_fd >= 0) {
+    close(capsule.udev_inotify_fd);
+  }
+  if (capsule.control.fd >= 0) {
+    close(capsule.control.fd);
+    unlink(capsule.control.path);
+  }
+  if (capsule.stats_page) {
+    munmap(capsule.stats_page, sizeof(*capsule.stats_page));
+    unlink(STATS_FILE_PATH);
+  }
+  if (capsule.mouse.timer_fd >= 0) {
+    close(capsule.mouse.timer_fd);
+  }
+  if (capsule.mouse.uinput_dev) {
+    libevdev_uinput_destroy(capsule.mouse.uinput_dev);
+    libevdev_free(capsule.mouse.dev);
+  }
+  if (capsule.epoll_fd >= 0) {
+    close(capsule.epoll_fd);
+  }
+
+  free(capsule.action_latency);
+  free(capsule.action_hits);
+  free((struct keymap*)capsule.keymap);
 
-  return -1;  // Can't get here without something being wrong
+  return exit_code;  // Only a clean exit by signal is a success
 }